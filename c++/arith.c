@@ -128,26 +128,18 @@ static char
 #if defined(VARY_NBITS)
          int		B_bits = B_BITS;		/* Default values */
          int		F_bits = F_BITS;
-  static code_value	Half;
-  static code_value	Quarter;
+  static THREAD_LOCAL code_value	Half;
+  static THREAD_LOCAL code_value	Quarter;
 #else
 #	 define		Half		((code_value) 1 << (B_bits-1))
 #	 define		Quarter		((code_value) 1 << (B_bits-2))
 #endif
 
-	/* Separate input and output */
-/* Input decoding state */
-static code_value	in_R;				/* code range */
-static code_value	in_D;				/* = V-L (V offset)*/
-static div_value	in_r;				/* normalized range */
-#ifdef FRUGAL_BITS
-static code_value	in_V;				/* Bitstream window */
-#endif
-
-/* Output encoding state */
-static code_value	out_L;				/* lower bound */
-static code_value	out_R;				/* code range */
-static unsigned long	out_bits_outstanding;		/* follow bit count */
+/* The state of each stream is in its coder_state (see arith.h), which
+ * every function here is given as 'cs': the coder in use, this one or one
+ * of those its functions pass calls on to, and the state of this one.
+ * Input and output state are separate, and each stream has its own.
+ */
 
 
 /*
@@ -159,24 +151,22 @@ static unsigned long	out_bits_outstanding;		/* follow bit count */
 #define ORIG_BIT_PLUS_FOLLOW(b)		\
 do                                      \
 { 	  			        \
-    OUTPUT_BIT((b));           		\
-    while (out_bits_outstanding > 0)	\
+    OUTPUT_BIT(&cs->io, (b));		\
+    while (cs->out_bits_outstanding > 0) \
     { 					\
-	OUTPUT_BIT(!(b));      		\
-	out_bits_outstanding--;    	\
+	OUTPUT_BIT(&cs->io, !(b));	\
+	cs->out_bits_outstanding--;	\
     } 	                		\
 } while (0)
 
 
 #ifdef FRUGAL_BITS
 
-    int _ignore_first_bit = 1;
-
 #  define BIT_PLUS_FOLLOW(x)		\
     do						\
     {						\
-      if (_ignore_first_bit)			\
-	_ignore_first_bit = 0;			\
+      if (cs->ignore_first_bit)			\
+	cs->ignore_first_bit = 0;		\
       else					\
 	ORIG_BIT_PLUS_FOLLOW(x);			\
     } while (0)
@@ -197,24 +187,24 @@ do                                      \
  */
 #define ENCODE_RENORMALISE		\
 do {					\
-    while (out_R <= Quarter)		\
+    while (cs->out_R <= Quarter)	\
     {					\
-        if (out_L >= Half)		\
+        if (cs->out_L >= Half)		\
     	{				\
     	    BIT_PLUS_FOLLOW(1);		\
-    	    out_L -= Half;		\
+    	    cs->out_L -= Half;		\
     	}				\
-    	else if (out_L+out_R <= Half)	\
+    	else if (cs->out_L+cs->out_R <= Half) \
     	{				\
     	    BIT_PLUS_FOLLOW(0);		\
     	}				\
     	else 				\
     	{				\
-    	    out_bits_outstanding++;	\
-    	    out_L -= Quarter;		\
+    	    cs->out_bits_outstanding++;	\
+    	    cs->out_L -= Quarter;	\
     	}				\
-    	out_L <<= 1;			\
-    	out_R <<= 1;			\
+    	cs->out_L <<= 1;		\
+    	cs->out_R <<= 1;		\
     }					\
 } while (0)
 
@@ -229,22 +219,22 @@ do {					\
 #ifdef FRUGAL_BITS
 #define DECODE_RENORMALISE			\
 do {                                            \
-    while (in_R <= Quarter)                     \
+    while (cs->in_R <= Quarter)			\
     {                                           \
-        in_R <<= 1;                             \
-        in_V <<= 1;                             \
-        ADD_NEXT_INPUT_BIT(in_D,B_bits);	\
-	if (in_D & 1)				\
-		in_V++;				\
+        cs->in_R <<= 1;				\
+        cs->in_V <<= 1;				\
+        ADD_NEXT_INPUT_BIT(&cs->io, cs->in_D,B_bits); \
+	if (cs->in_D & 1)			\
+		cs->in_V++;			\
     }                                           \
 } while (0)
 #else
 #define DECODE_RENORMALISE			\
 do {						\
-    while (in_R <= Quarter)			\
+    while (cs->in_R <= Quarter)			\
     {						\
-    	in_R <<= 1;				\
-    	ADD_NEXT_INPUT_BIT(in_D,0);		\
+    	cs->in_R <<= 1;				\
+    	ADD_NEXT_INPUT_BIT(&cs->io, cs->in_D,0); \
     }						\
 } while (0)
 #endif
@@ -255,7 +245,8 @@ do {						\
  * encode a symbol given its low, high and total frequencies
  *
  */
-void arithmetic_encode(freq_value low, freq_value high, freq_value total)
+void arithmetic_encode(coder_state *cs, freq_value low, freq_value high,
+		       freq_value total)
 { 
   /* The following pseudocode is a concise (but slow due to arithmetic
    * calculations) description of what is calculated in this function.
@@ -296,16 +287,27 @@ void arithmetic_encode(freq_value low, freq_value high, freq_value total)
 
     code_value temp; 
 
+    if (cs->type == RANGE_CODER)
+    {
+	range_encode(cs, low, high, total);
+	return;
+    }
+    if (cs->type == RANS_CODER)
+    {
+	rans_encode(cs, low, high, total);
+	return;
+    }
+
 #ifdef MULT_DIV
    {
     div_value out_r;			
-    out_r = out_R/total;		/* Calc range:freq ratio */
+    out_r = cs->out_R/total;		/* Calc range:freq ratio */
     temp = out_r*low;			/* Calc low increment */
-    out_L += temp;			/* Increase L */
+    cs->out_L += temp;			/* Increase L */
     if (high < total)
-	out_R = out_r*(high-low);	/* Restrict R */
+	cs->out_R = out_r*(high-low);	/* Restrict R */
     else
-	out_R -= temp;			/* If at end of freq range */
+	cs->out_R -= temp;		/* If at end of freq range */
 					/* Give symbol excess code range */
    }
 #else
@@ -318,7 +320,7 @@ void arithmetic_encode(freq_value low, freq_value high, freq_value total)
      * using shifts and adds  (r need not be stored as it is implicit in the
      * loop)
      */
-    A = out_R;
+    A = cs->out_R;
     temp = 0;
     temp2 = 0;
 
@@ -351,17 +353,17 @@ void arithmetic_encode(freq_value low, freq_value high, freq_value total)
 
 #   endif			/* Varying/nonvarying shifts */
 
-    out_L += temp;
+    cs->out_L += temp;
     if (high < total)
-	out_R = temp2 - temp;
+	cs->out_R = temp2 - temp;
     else
-	out_R -= temp;
+	cs->out_R -= temp;
   }
 #endif
 
     ENCODE_RENORMALISE;
 
-    if (out_bits_outstanding > MAX_BITS_OUTSTANDING)
+    if (cs->out_bits_outstanding > MAX_BITS_OUTSTANDING)
     {
 /* 
  * For MAX_BITS_OUTSTANDING to be exceeded is extremely improbable, but
@@ -409,20 +411,25 @@ void arithmetic_encode(freq_value low, freq_value high, freq_value total)
  *				* range (total-1)			*
  *
  */
-freq_value arithmetic_decode_target(freq_value total)
+freq_value arithmetic_decode_target(coder_state *cs, freq_value total)
 {
     freq_value target;
     
+    if (cs->type == RANGE_CODER)
+	return range_decode_target(cs, total);
+    if (cs->type == RANS_CODER)
+	return rans_decode_target(cs, total);
+
 #ifdef MULT_DIV
-    in_r = in_R/total;
-    target = (in_D)/in_r;
+    cs->in_r = cs->in_R/total;
+    target = (cs->in_D)/cs->in_r;
 #else 
    {	
     code_value A, M;		/* A = numerator, M = denominator */
 
     /* divide r = R/total using shifts and adds */
-    A = in_R;
-    in_r = 0;
+    A = cs->in_R;
+    cs->in_r = 0;
 #   ifdef  VARY_NBITS
     {
 	int i, nShifts;
@@ -430,18 +437,18 @@ freq_value arithmetic_decode_target(freq_value total)
 	M = total << nShifts;
 	for (i = nShifts;; i--) 
 	{
-	  if (A >= M) { A -= M; in_r++; }
+	  if (A >= M) { A -= M; cs->in_r++; }
 	  if (i == 0) break;
-	  A <<= 1; in_r <<= 1;
+	  A <<= 1; cs->in_r <<= 1;
 	}
     
     /* divide D by r using shifts and adds */
-    if (in_r < (1 << (B_bits - F_bits - 1)))
+    if (cs->in_r < (1 << (B_bits - F_bits - 1)))
 	nShifts = F_bits;
     else
 	nShifts = F_bits - 1;
-    A = in_D;
-    M = in_r << nShifts;
+    A = cs->in_D;
+    M = cs->in_r << nShifts;
     target = 0;
     for (i = nShifts;; i--) 
     {
@@ -456,24 +463,24 @@ freq_value arithmetic_decode_target(freq_value total)
   }
 #   else
 	M = total << ( B_bits - F_bits - 1 );
-	if (A >= M) { A -= M; in_r++; }
+	if (A >= M) { A -= M; cs->in_r++; }
 
 #       define UNROLL_NUM	B_bits - F_bits - 1
 #       define UNROLL_CODE			\
-	   A <<= 1; in_r <<= 1;			\
-	   if (A >= M) { A -= M; in_r++; }
+	   A <<= 1; cs->in_r <<= 1;		\
+	   if (A >= M) { A -= M; cs->in_r++; }
 #       include "unroll.i"
 
-        A = in_D;
+        A = cs->in_D;
         target = 0;
-        if (in_r < (1 << (B_bits - F_bits - 1)))
-	    { M = in_r << F_bits; 
+        if (cs->in_r < (1 << (B_bits - F_bits - 1)))
+	    { M = cs->in_r << F_bits; 
 	       if (A >= M) { A -= M; target++; }	
 	       A <<= 1; target <<= 1;		
 	    }
         else
 	    {
-	        M = in_r << (F_bits - 1);
+	        M = cs->in_r << (F_bits - 1);
 	    }
 
        if (A >= M) { A -= M; target++; }
@@ -513,18 +520,30 @@ freq_value arithmetic_decode_target(freq_value total)
  *
  */
 
-void arithmetic_decode(freq_value low, freq_value high, freq_value total)
+void arithmetic_decode(coder_state *cs, freq_value low, freq_value high,
+		       freq_value total)
 {     
     code_value temp;
 
+    if (cs->type == RANGE_CODER)
+    {
+	range_decode(cs, low, high, total);
+	return;
+    }
+    if (cs->type == RANS_CODER)
+    {
+	rans_decode(cs, low, high, total);
+	return;
+    }
+
 #ifdef MULT_DIV
     /* assume r has been set by decode_target */
-    temp = in_r*low;
-    in_D -= temp;
+    temp = cs->in_r*low;
+    cs->in_D -= temp;
     if (high < total)
-	in_R = in_r*(high-low);
+	cs->in_R = cs->in_r*(high-low);
     else
-	in_R -= temp;
+	cs->in_R -= temp;
 #else
 {
     code_value temp2, M;
@@ -536,7 +555,7 @@ void arithmetic_decode(freq_value low, freq_value high, freq_value total)
 #   ifdef VARY_NBITS
     {
       int i, nShifts;
-      M = in_r << F_bits;
+      M = cs->in_r << F_bits;
       nShifts = B_bits - F_bits - 1;
       for (i = nShifts;; i--) 
       {
@@ -550,7 +569,7 @@ void arithmetic_decode(freq_value low, freq_value high, freq_value total)
       }
     }
 #   else
-      M = in_r << F_bits;
+      M = cs->in_r << F_bits;
 
       if (M & Half) { temp += low; temp2 += high; }
 
@@ -562,11 +581,11 @@ void arithmetic_decode(freq_value low, freq_value high, freq_value total)
 
 #   endif		/* Varying/not varying nshifts */
 
-    in_D -= temp;
+    cs->in_D -= temp;
     if (high < total)
-	in_R = temp2 - temp;
+	cs->in_R = temp2 - temp;
     else
-	in_R -= temp;
+	cs->in_R -= temp;
  }
 #endif		/* Shifts vs multiply */
 
@@ -603,11 +622,23 @@ void arithmetic_decode(freq_value low, freq_value high, freq_value total)
  *					* in arithmetic_encode() )	*
  *
  */
-void binary_arithmetic_encode(freq_value c0, freq_value c1, int bit)
+void binary_arithmetic_encode(coder_state *cs, freq_value c0, freq_value c1,
+			      int bit)
 {
     int LPS;
     freq_value cLPS, rLPS;
 
+    if (cs->type == RANGE_CODER)
+    {
+	range_binary_encode(cs, c0, c1, bit);
+	return;
+    }
+    if (cs->type == RANS_CODER)
+    {
+	rans_binary_encode(cs, c0, c1, bit);
+	return;
+    }
+
     if (c0 < c1) 		/* From frequencies (c0 and c1) determine */ 
     {				/* least probable symbol (LPS) and its	*/
 	LPS = 0;		/* count (cLPS)				*/
@@ -619,14 +650,14 @@ void binary_arithmetic_encode(freq_value c0, freq_value c1, int bit)
 #ifdef MULT_DIV
     {
      div_value out_r;
-     out_r = out_R / (c0+c1);
+     out_r = cs->out_R / (c0+c1);
      rLPS = out_r * cLPS;
     }
 #else
    {	
     code_value numerator, denominator;
 
-    numerator = out_R;
+    numerator = cs->out_R;
     rLPS = 0;
 
 #  ifdef VARY_NBITS
@@ -669,16 +700,16 @@ void binary_arithmetic_encode(freq_value c0, freq_value c1, int bit)
 
     if (bit == LPS) 
     {
-	out_L += out_R - rLPS;
-	out_R = rLPS;
+	cs->out_L += cs->out_R - rLPS;
+	cs->out_R = rLPS;
     } else {
-	out_R -= rLPS;
+	cs->out_R -= rLPS;
     }
 
     /* renormalise, as for arith_encode */
     ENCODE_RENORMALISE;
 
-    if (out_bits_outstanding > MAX_BITS_OUTSTANDING)
+    if (cs->out_bits_outstanding > MAX_BITS_OUTSTANDING)
     {
 	fprintf(stderr,"Bits_outstanding limit reached - File too large\n");
 	exit(EXIT_FAILURE);
@@ -715,12 +746,17 @@ void binary_arithmetic_encode(freq_value c0, freq_value c1, int bit)
  *
  */
 int
-binary_arithmetic_decode(freq_value c0, freq_value c1)
+binary_arithmetic_decode(coder_state *cs, freq_value c0, freq_value c1)
 {
     int LPS;
     int bit;
     freq_value cLPS, rLPS;
 
+    if (cs->type == RANGE_CODER)
+	return range_binary_decode(cs, c0, c1);
+    if (cs->type == RANS_CODER)
+	return rans_binary_decode(cs, c0, c1);
+
     if (c0 < c1) 
     {
 	LPS = 0;
@@ -730,14 +766,14 @@ binary_arithmetic_decode(freq_value c0, freq_value c1)
 	cLPS = c1;
     }
 #ifdef MULT_DIV
-    in_r = in_R / (c0+c1);
-    rLPS = in_r * cLPS;
+    cs->in_r = cs->in_R / (c0+c1);
+    rLPS = cs->in_r * cLPS;
 #else 
    {
     code_value numerator, denominator;
 
-    numerator = in_R;
-    in_r = 0;
+    numerator = cs->in_R;
+    cs->in_r = 0;
     rLPS = 0;
 
 #   ifdef VARY_NBITS
@@ -775,14 +811,14 @@ binary_arithmetic_decode(freq_value c0, freq_value c1)
 #   endif
    }
 #endif		/* MULT_DIV / non MULT_DIV */
-    if ((in_D) >= (in_R-rLPS)) 
+    if ((cs->in_D) >= (cs->in_R-rLPS)) 
     {
 	bit = LPS;
-	in_D -= (in_R - rLPS);
-	in_R = rLPS;
+	cs->in_D -= (cs->in_R - rLPS);
+	cs->in_R = rLPS;
     } else {
 	bit = (1-LPS);
-	in_R -= rLPS;
+	cs->in_R -= rLPS;
     }
 
     /* renormalise, as for arith_decode */
@@ -800,8 +836,19 @@ binary_arithmetic_decode(freq_value c0, freq_value c1)
  * With FRUGAL_BITS, ensure first bit (always 0) not actually output.
  *
  */
-void start_encode(void)
+void start_encode(coder_state *cs)
 {
+    if (cs->type == RANGE_CODER)
+    {
+	range_start_encode(cs);
+	return;
+    }
+    if (cs->type == RANS_CODER)
+    {
+	rans_start_encode(cs);
+	return;
+    }
+
 #if defined(VARY_NBITS)
 	/* Assume B_bits and F_bits have been selected (in main.c) */
 	/* Set up Half, Quarter for this coding run	*/
@@ -809,11 +856,11 @@ void start_encode(void)
     Quarter 	  = ((code_value) 1 << (B_bits-2));
 #endif
 
-    out_L = 0;				/* Set initial coding range to	*/
-    out_R = Half;			/* [0,Half)			*/
-    out_bits_outstanding = 0;
+    cs->out_L = 0;			/* Set initial coding range to	*/
+    cs->out_R = Half;		/* [0,Half)			*/
+    cs->out_bits_outstanding = 0;
 #ifdef FRUGAL_BITS
-    _ignore_first_bit = 1;		/* Don't ouput the leading 0	*/
+    cs->ignore_first_bit = 1;		/* Don't ouput the leading 0	*/
 #endif
 }
 
@@ -831,16 +878,29 @@ void start_encode(void)
  * Loop, increasing "nbits" until both the above values fall within [L,L+R),
  * then output these "nbits" of L
  */
-void finish_encode(void)
+void finish_encode(coder_state *cs)
 {
   int nbits, i;
   code_value roundup, bits, value;
+
+  if (cs->type == RANGE_CODER)
+    {
+      range_finish_encode(cs);
+      return;
+    }
+  if (cs->type == RANS_CODER)
+    {
+      rans_finish_encode(cs);
+      return;
+    }
+
   for (nbits = 1; nbits <= B_bits; nbits++)
     {
 	roundup = (1 << (B_bits - nbits)) - 1;
-	bits = (out_L + roundup) >> (B_bits - nbits);
+	bits = (cs->out_L + roundup) >> (B_bits - nbits);
 	value = bits << (B_bits - nbits);
-	if (out_L <= value && value + roundup <= (out_L + (out_R - 1)) )
+	if (cs->out_L <= value &&
+	    value + roundup <= (cs->out_L + (cs->out_R - 1)) )
 		break;
     }
   for (i = 1; i <= nbits; i++)        /* output the nbits integer bits */
@@ -855,13 +915,24 @@ void finish_encode(void)
  * have been valid input.
  *
  */
-void finish_encode(void)
+void finish_encode(coder_state *cs)
 {
   int nbits, i;
   code_value bits;
 
+  if (cs->type == RANGE_CODER)
+    {
+      range_finish_encode(cs);
+      return;
+    }
+  if (cs->type == RANS_CODER)
+    {
+      rans_finish_encode(cs);
+      return;
+    }
+
   nbits = B_bits;
-  bits  = out_L;
+  bits  = cs->out_L;
   for (i = 1; i <= nbits; i++)        /* output the nbits integer bits */
         BIT_PLUS_FOLLOW(((bits >> (nbits-i)) & 1));
 }
@@ -882,46 +953,54 @@ void finish_encode(void)
  * into the input stream.
  */
 void 
-start_decode(void)
+start_decode(coder_state *cs)
 {
  int i;
+
+  if (cs->type == RANGE_CODER)
+    {
+      range_start_decode(cs);
+      return;
+    }
+  if (cs->type == RANS_CODER)
+    {
+      rans_start_decode(cs);
+      return;
+    }
+
 #if defined(VARY_NBITS)
 	/* B_bits will have been selected */
     Half	  = ((code_value) 1 << (B_bits-1));
     Quarter 	  = ((code_value) 1 << (B_bits-2));
 #endif
 
-  in_D = 0;			/* Initial offset in range is 0 */
-  in_R = Half;			/* Range = Half */
+  cs->in_D = 0;			/* Initial offset in range is 0 */
+  cs->in_R = Half;		/* Range = Half */
 
 #ifdef FRUGAL_BITS
   {
-    static int firstmessage = 1;
-    if (firstmessage)
+    if (!cs->in_started)
 	{
 	    for (i = 0; i < B_bits-1; i++)
-		ADD_NEXT_INPUT_BIT(in_D, B_bits);
+		ADD_NEXT_INPUT_BIT(&cs->io, cs->in_D, B_bits);
 	}
     else
 	{
-	    in_D = retrieve_excess_input_bits();
-	    unget_bit(in_D & 1);
-	    in_D >>=1;
+	    cs->in_D = retrieve_excess_input_bits(cs);
+	    unget_bit(&cs->io, cs->in_D & 1);
+	    cs->in_D >>=1;
 	}
 
-    firstmessage = 0;
-    in_V = in_D;
+    cs->in_started = 1;
+    cs->in_V = cs->in_D;
   }
 #else
   for (i = 0; i<B_bits; i++)			/* Fill D */
-	ADD_NEXT_INPUT_BIT(in_D, 0);
+	ADD_NEXT_INPUT_BIT(&cs->io, cs->in_D, 0);
 #endif
 
-  if (in_D >= Half)
-	{
-	  fprintf(stderr,"Corrupt input file (start_decode())\n");
-	  exit(EXIT_FAILURE);
-	}
+  if (cs->in_D >= Half)
+	bitio_error("Corrupt input file (start_decode())");
 }
 
 #ifdef FRUGAL_BITS
@@ -935,29 +1014,32 @@ start_decode(void)
  * retrieve_excess_input_bits() )
  *
  */
-void finish_decode(void)
+void finish_decode(coder_state *cs)
 {
   int nbits, i;
   code_value roundup, bits, value;
   code_value in_L;
 
+  if (cs->type != ARITHMETIC_CODER)
+    return;
+
   /* This gets us either the real L, or L + Half.  Either way, we can work
    * out the number of bit emitted by the encoder
    */
-  in_L = (in_V & (Half-1))+ Half - in_D;
+  in_L = (cs->in_V & (Half-1))+ Half - cs->in_D;
 
   for (nbits = 1; nbits <= B_bits; nbits++)
     {
         roundup = (1 << (B_bits - nbits)) - 1;
         bits = (in_L + roundup) >> (B_bits - nbits);
         value = bits << (B_bits - nbits);
-        if (in_L <= value && value + roundup <= (in_L + (in_R - 1)) )
+        if (in_L <= value && value + roundup <= (in_L + (cs->in_R - 1)) )
                 break;
     }
 
     for (i = 1; i <= nbits; i++)
         {
-        ADD_NEXT_INPUT_BIT(in_V, B_bits);
+        ADD_NEXT_INPUT_BIT(&cs->io, cs->in_V, B_bits);
         }
 }
 
@@ -965,9 +1047,9 @@ void finish_decode(void)
  *   With FRUGAL_BITS defined, B_bits beyond valid coding output are read.
  *   It is these excess bits that are returned by calling this function.
  */
-code_value retrieve_excess_input_bits(void)
+code_value retrieve_excess_input_bits(coder_state *cs)
 {
-	return (in_V & (Half + (Half-1)) );
+	return (cs->in_V & (Half + (Half-1)) );
 }
 
 #else
@@ -979,8 +1061,73 @@ code_value retrieve_excess_input_bits(void)
  * (encoder wrote these for us to consume.)
  * (They were mangled anyway as we only kept V-L, and cannot get back to V)
  */
-void finish_decode(void)
+void finish_decode(coder_state *cs)
 {
 	/* No action */
 }
 #endif
+
+
+/*
+ * write_coder()
+ * write the stream of 'cs', about to be started, with the coder 'type', and
+ * say so in the header at its start, with the version of the format and
+ * the flags of the model that compress.cc codes with it (at most three,
+ * MODEL_FLAGS).
+ */
+void write_coder(coder_state *cs, int type, int flags)
+{
+    cs->type = type;
+    cs->version = FORMAT_VERSION;
+    OUTPUT_BYTE(&cs->io, FORMAT_MAGIC);
+    OUTPUT_BYTE(&cs->io, FORMAT_VERSION);
+    OUTPUT_BYTE(&cs->io, (flags << MODEL_SHIFT) | type);
+}
+
+/*
+ * read_coder()
+ * find out which version of the format, and which coder, the stream about
+ * to be read was written with, and return the flags of its model, for the
+ * caller to check that it knows them all.  A stream with no header
+ * (version 0) is one of the arithmetic coder, with no flags.
+ */
+int read_coder(coder_state *cs)
+{
+    int c = INPUT_BYTE(&cs->io);
+    char message[64];
+
+    cs->type = ARITHMETIC_CODER;
+    cs->version = 0;
+    if (c == EOF)
+	return 0;
+    if (!(c & 0x80))
+    {
+	unsigned char byte = c;
+#ifndef FAST_BITIO
+	cs->io.bytes_input--;
+#endif
+	bitio_unread(&cs->io, &byte, 1);
+	return 0;
+    }
+
+    if (c != FORMAT_MAGIC)
+	bitio_error("Not a compressed file, or one of an unknown format");
+    cs->version = INPUT_BYTE(&cs->io);
+    if (cs->version != FORMAT_VERSION)
+    {
+	snprintf(message, sizeof(message), "Compressed with an unknown "
+		 "version of the format (%d)", cs->version);
+	bitio_error(message);
+    }
+
+    c = INPUT_BYTE(&cs->io);
+    cs->type = c & ((1 << MODEL_SHIFT) - 1);
+    if (c == EOF || (cs->type != ARITHMETIC_CODER && cs->type != RANGE_CODER &&
+		     cs->type != RANS_CODER) || (c >> MODEL_SHIFT) > MODEL_FLAGS)
+    {
+	snprintf(message, sizeof(message),
+		 "Compressed with an unknown coder (%d)", c);
+	bitio_error(message);
+    }
+    return c >> MODEL_SHIFT;
+}
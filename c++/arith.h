@@ -27,6 +27,8 @@ part of each and every copy made of these files.
 #ifndef CODER_H
 #define CODER_H
 
+#include "bitio.h"
+
 /* ================= USER ADJUSTABLE PARAMETERS =================== */
 
 	/* Default B_bits and F_bits */
@@ -85,7 +87,7 @@ typedef unsigned long	div_value;	/* B_BITS-F_BITS of precision */
   in the decoder, but slows the encoder which checks each time a bit
   is output whether it is the first bit of a coding sequence.
   The encoder would not need to be slowed by this if coding always began at
-  the start of a byte (simply increase _bits_to_go in bitio.c), but we
+  the start of a byte (simply increase out_bits_to_go in bitio.c), but we
   are allowing for consecutive coding sequences (start_encode(); ...
   finish_encode(); pairs) in the same bitstream.
 
@@ -124,20 +126,115 @@ typedef unsigned long	div_value;	/* B_BITS-F_BITS of precision */
 extern char *coder_desc;
 
 
+/* The coder a stream is written with: the arithmetic coder of arith.c, the
+ * range coder of range.c, or the rANS coder of rans.c.  The functions below
+ * use the one in the type of the coder_state they are given, which
+ * write_coder() sets when a stream is started, and read_coder() when one
+ * is read.
+ */
+#define		ARITHMETIC_CODER	0
+#define		RANGE_CODER		1
+#define		RANS_CODER		2
+
+/* A stream starts with FORMAT_MAGIC, the version of its format, and a
+ * byte naming the coder, which also holds, above it, the flags of the
+ * model the stream was coded with (see compress.cc).  Files written before
+ * there was a header start with arith.c's output, whose first bit is
+ * always 0, so they are told apart by the top bit of the first byte; they
+ * are version 0 of the format.
+ */
+#define		FORMAT_MAGIC		0xd3	/* 'S' | 0x80 */
+#define		FORMAT_VERSION		1
+#define		MODEL_SHIFT		4
+#define		MODEL_FLAGS		7
+
+typedef unsigned long long code64;	/* state of the range coder */
+
+#define		RANS_STATES		2	/* interleaved in rans.c */
+
+/* The state of a coded stream: its bits, the coder it is written with,
+ * and the state of that coder, encoding or decoding.  Each stream has a
+ * coder_state of its own, which every function below (and those of
+ * stats.c) is given as 'cs', so that any number of streams can be coded at
+ * once, on one thread or several.  A coder_state starts out zeroed.
+ */
+typedef struct {
+    bitio	io;
+    int		type;			/* ARITHMETIC_CODER, ... */
+    int		version;		/* of the format of the stream */
+
+    /* arith.c; input and output are kept apart (see there) */
+    code_value	in_R;			/* code range */
+    code_value	in_D;			/* = V-L (V offset) */
+    div_value	in_r;			/* normalized range */
+    code_value	in_V;			/* Bitstream window (FRUGAL_BITS) */
+    int		in_started;		/* in_V holds bits (FRUGAL_BITS) */
+
+    code_value	out_L;			/* lower bound */
+    code_value	out_R;			/* code range */
+    unsigned long out_bits_outstanding;	/* follow bit count */
+    int		ignore_first_bit;	/* FRUGAL_BITS */
+
+    struct {				/* range.c */
+	code64	in_low, in_range, in_code;
+	code64	in_r;			/* range / total */
+	code64	out_low, out_range;
+    } range;
+
+    struct {				/* rans.c */
+	unsigned int *out_start, *out_freq;	/* of the segment so far */
+	int	out_count;
+	unsigned int *out_words;	/* coded segment */
+	code64	in_x[RANS_STATES];
+	int	in_count;		/* of the segment */
+	code64	in_slot;		/* of the symbol */
+    } rans;
+} coder_state;
+
+void write_coder(coder_state *cs, int type, int flags);
+int read_coder(coder_state *cs);
+
+void range_encode(coder_state *cs, freq_value l, freq_value h,
+                  freq_value t);
+freq_value range_decode_target(coder_state *cs, freq_value t);
+void range_decode(coder_state *cs, freq_value l, freq_value h,
+                  freq_value t);
+void range_binary_encode(coder_state *cs, freq_value c0, freq_value c1,
+                         int bit);
+int range_binary_decode(coder_state *cs, freq_value c0, freq_value c1);
+void range_start_encode(coder_state *cs);
+void range_finish_encode(coder_state *cs);
+void range_start_decode(coder_state *cs);
+
+void rans_encode(coder_state *cs, freq_value l, freq_value h,
+                 freq_value t);
+freq_value rans_decode_target(coder_state *cs, freq_value t);
+void rans_decode(coder_state *cs, freq_value l, freq_value h,
+                 freq_value t);
+void rans_binary_encode(coder_state *cs, freq_value c0, freq_value c1,
+                        int bit);
+int rans_binary_decode(coder_state *cs, freq_value c0, freq_value c1);
+void rans_start_encode(coder_state *cs);
+void rans_finish_encode(coder_state *cs);
+void rans_start_decode(coder_state *cs);
+
+
 /* function prototypes */
-void arithmetic_encode(freq_value l, freq_value h, freq_value t);
-freq_value arithmetic_decode_target(freq_value t);
-void arithmetic_decode(freq_value l, freq_value h, freq_value t);
-void binary_arithmetic_encode(freq_value c0, freq_value c1, int bit);
-int binary_arithmetic_decode(freq_value c0, freq_value c1);
-void start_encode(void);
-void finish_encode(void);
-void start_decode(void);
-void finish_decode(void);
+void arithmetic_encode(coder_state *cs, freq_value l, freq_value h,
+                       freq_value t);
+freq_value arithmetic_decode_target(coder_state *cs, freq_value t);
+void arithmetic_decode(coder_state *cs, freq_value l, freq_value h,
+                       freq_value t);
+void binary_arithmetic_encode(coder_state *cs, freq_value c0, freq_value c1,
+			      int bit);
+int binary_arithmetic_decode(coder_state *cs, freq_value c0, freq_value c1);
+void start_encode(coder_state *cs);
+void finish_encode(coder_state *cs);
+void start_decode(coder_state *cs);
+void finish_decode(coder_state *cs);
 
 #ifdef FRUGAL_BITS
-extern int	_ignore_first_bit;
-code_value retrieve_excess_input_bits(void);
+code_value retrieve_excess_input_bits(coder_state *cs);
 #endif
 
 #endif		/* ifndef arith.h */
@@ -0,0 +1,449 @@
+/****************************************************************************
+
+ bench.cc - Microbenchmarks of the kernels that sequitur spends its time
+            in, so that a change that slows one of them down shows up
+            before it reaches a whole run ("make bench").
+
+     find_digram   lookups in the digram hash table (Grammar::find_digram())
+                   of a grammar grown to a given occupancy of its table
+     check         Grammar::append(), a symbols::check() of each digram
+                   formed, per symbol appended
+     expand        decompression in memory (sequitur::decompress()), per
+                   symbol written: for repetitive input, almost all of it
+                   is the expansion of rules (expand() in compress.cc);
+                   compressed files are of bytes, so not for alphabets
+                   over 256
+     encode        encode() and decode() of stats.c, a symbol of a static
+     decode        context holding the whole alphabet, with arith.c
+     arithmetic_encode
+                   arithmetic_encode() of a symbol of the alphabet, equally
+                   likely, with each coder of --coder
+
+ Each is run for each input (random: symbols equally likely; repetitive:
+ phrases repeated, with a symbol changed now and then; text: words of a
+ vocabulary, used with Zipf's law, between separators), alphabet size and,
+ where they apply, K and occupancy of the table. Each time is the best of
+ a few runs.
+
+ The results are written to standard output as JSON, one object per line
+ in an array, with the time per operation and, where perf_event_open() is
+ there and allowed, the cache misses per operation (null otherwise).
+
+     usage: sequitur_bench [symbols] [kernel ...]
+
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "classes.h"
+#include "compress.h"
+
+extern "C" {
+#include "arith.h"
+#include "stats.h"
+#include "bitio.h"
+}
+
+enum { RUNS = 3,                       // each time is the best of these
+       TABLE_MEMORY = 1 << 21 };       // bytes of the find_digram table
+
+static const int alphabets[] = { 4, 256, 65536 };
+static const int ks[] = { 2, 4 };
+static const double occupancies[] = { 0.25, 0.6 };
+static const char *inputs[] = { "random", "repetitive", "text" };
+
+static size_t n = 1 << 20;             // symbols of input for each kernel
+static vector<string> wanted;          // kernels to run, or all if empty
+static bool first_result = true;
+
+
+// **************************************************************************
+// Inputs
+// **************************************************************************
+
+// xorshift64*, so that the inputs are the same on every system
+static uint64_t seed;
+
+static uint32_t next_random()
+{
+  seed ^= seed >> 12;
+  seed ^= seed << 25;
+  seed ^= seed >> 27;
+  return uint32_t((seed * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+// n symbols of the given type, from an alphabet of the given size
+static vector<uint32_t> make_input(const string &type, int alphabet, size_t n)
+{
+  vector<uint32_t> in;
+  in.reserve(n + 64);
+  seed = 0x9e3779b97f4a7c15ULL;
+
+  if (type == "random")
+    while (in.size() < n) in.push_back(next_random() % alphabet);
+
+  else if (type == "repetitive") {
+    vector<vector<uint32_t> > phrases(64);
+    for (size_t i = 0; i < phrases.size(); i ++) {
+      phrases[i].resize(8 + next_random() % 57);
+      for (size_t j = 0; j < phrases[i].size(); j ++)
+	phrases[i][j] = next_random() % alphabet;
+    }
+    while (in.size() < n) {
+      vector<uint32_t> &p = phrases[next_random() % phrases.size()];
+      in.insert(in.end(), p.begin(), p.end());
+      if (next_random() % 16 == 0)
+	in[in.size() - 1 - next_random() % p.size()] = next_random() % alphabet;
+    }
+  }
+
+  else {
+    // words of 1 to 8 symbols other than the separator, 0; word r of the
+    // vocabulary is used in proportion to 1/r
+    enum { WORDS = 4096 };
+    vector<vector<uint32_t> > words(WORDS);
+    vector<double> cumulative(WORDS);
+    double total = 0;
+    for (int i = 0; i < WORDS; i ++) {
+      words[i].resize(1 + next_random() % 8);
+      for (size_t j = 0; j < words[i].size(); j ++)
+	words[i][j] = 1 + next_random() % (alphabet - 1);
+      cumulative[i] = total += 1.0 / (i + 1);
+    }
+    while (in.size() < n) {
+      double x = next_random() / 4294967296.0 * total;
+      int w = upper_bound(cumulative.begin(), cumulative.end(), x) -
+	cumulative.begin();
+      vector<uint32_t> &word = words[min(w, WORDS - 1)];
+      in.insert(in.end(), word.begin(), word.end());
+      in.push_back(0);
+    }
+  }
+
+  in.resize(n);
+  return in;
+}
+
+
+// **************************************************************************
+// Timing, and cache misses where the kernel will count them
+// **************************************************************************
+
+static double seconds()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+#ifdef __linux__
+static int misses_fd = -2;             // -2 until opened, -1 if not there
+
+static void start_counting()
+{
+  if (misses_fd == -2) {
+    struct perf_event_attr a;
+    memset(&a, 0, sizeof(a));
+    a.type = PERF_TYPE_HARDWARE;
+    a.size = sizeof(a);
+    a.config = PERF_COUNT_HW_CACHE_MISSES;
+    a.disabled = 1;
+    a.exclude_kernel = 1;
+    a.exclude_hv = 1;
+    misses_fd = syscall(__NR_perf_event_open, &a, 0, -1, -1, 0);
+  }
+  if (misses_fd < 0) return;
+  ioctl(misses_fd, PERF_EVENT_IOC_RESET, 0);
+  ioctl(misses_fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+// cache misses since start_counting(), or -1 if they cannot be counted
+static long long stop_counting()
+{
+  long long count;
+  if (misses_fd < 0) return -1;
+  ioctl(misses_fd, PERF_EVENT_IOC_DISABLE, 0);
+  if (read(misses_fd, &count, sizeof(count)) != sizeof(count)) return -1;
+  return count;
+}
+#else
+static void start_counting() {}
+static long long stop_counting() { return -1; }
+#endif
+
+// the best of the runs of a kernel so far
+struct timing {
+  double best;
+  long long misses;
+
+  timing() : best(1e30), misses(-1) {}
+  void start() { start_counting(); begin = seconds(); }
+  void stop() {
+    double t = seconds() - begin;
+    long long m = stop_counting();
+    if (t < best) {
+      best = t;
+      misses = m;
+    }
+  }
+
+private:
+  double begin;
+};
+
+static bool wants(const char *kernel)
+{
+  return wanted.empty() ||
+    find(wanted.begin(), wanted.end(), kernel) != wanted.end();
+}
+
+// Write a result, with the parameters that apply (the others are 0).
+static void result(const char *kernel, const string &input, int alphabet,
+		   int k, double occupancy, const char *coder_name,
+		   size_t ops, const timing &t)
+{
+  printf("%s\n  {\"kernel\": \"%s\", \"input\": \"%s\", \"alphabet\": %d",
+	 first_result ? "[" : ",", kernel, input.c_str(), alphabet);
+  if (k) printf(", \"k\": %d", k);
+  if (occupancy) printf(", \"occupancy\": %.3f", occupancy);
+  if (coder_name) printf(", \"coder\": \"%s\"", coder_name);
+  printf(", \"ops\": %lu, \"ns_per_op\": %.2f, \"cache_misses_per_op\": ",
+	 (unsigned long) ops, t.best * 1e9 / ops);
+  if (t.misses < 0) printf("null}");
+  else printf("%.3f}", double(t.misses) / ops);
+  fflush(stdout);
+  first_result = false;
+}
+
+
+// **************************************************************************
+// The kernels
+// **************************************************************************
+
+// Grammar::find_digram() is private; the benchmark is a friend of Grammar.
+class benchmark {
+public:
+  static void find_digram(const string &type, int alphabet, int k,
+			  double occupancy);
+};
+
+// Add each symbol of rule S, and of the rules under it, that starts a
+// digram to 'found'; rules are marked with index 1 once they are taken.
+static void digrams_of(rules *S, vector<symbols *> &found)
+{
+  vector<rules *> stack(1, S);
+  S->index(1);
+  while (!stack.empty()) {
+    rules *r = stack.back();
+    stack.pop_back();
+    for (symbols *s = r->first(); !s->is_guard(); s = s->next()) {
+      if (!s->next()->is_guard()) found.push_back(s);
+      if (s->non_terminal() && s->rule()->index() == 0) {
+	s->rule()->index(1);
+	stack.push_back(s->rule());
+      }
+    }
+  }
+}
+
+// Grow a grammar until its table, which may not grow past TABLE_MEMORY,
+// is as occupied as asked (or the input runs out), and look up the
+// digrams it holds.
+void benchmark::find_digram(const string &type, int alphabet, int k,
+			    double occupancy)
+{
+  vector<uint32_t> in = make_input(type, alphabet, 4 * n);
+  sequitur::Grammar g(k, -1, TABLE_MEMORY, true);
+  for (size_t i = 0; i < in.size(); i += 4096) {
+    bool full_size = g.table.buckets &&
+      g.table.size >= TABLE_MEMORY / g.bucket_bytes;
+    if (full_size && !g.old_table.buckets && g.occupancy() >= occupancy)
+      break;
+    g.append(&in[i], min(in.size() - i, (size_t) 4096));
+  }
+  while (g.old_table.buckets) g.rehash_step();
+
+  vector<symbols *> digrams;
+  digrams_of(g.start(), digrams);
+  if (digrams.empty()) return;
+
+  timing t;
+  uintptr_t sum = 0;
+  for (int run = 0; run < RUNS; run ++) {
+    t.start();
+    for (size_t i = 0, j = 0; i < n; i ++) {
+      sum += uintptr_t(g.find_digram(digrams[j]));
+      if (++ j == digrams.size()) j = 0;
+    }
+    t.stop();
+  }
+  if (sum == 1) printf(" ");           // so that the lookups are not dropped
+  result("find_digram", type, alphabet, k, g.occupancy(), 0, n, t);
+}
+
+static void check(const string &type, int alphabet, int k)
+{
+  vector<uint32_t> in = make_input(type, alphabet, n);
+  timing t;
+
+  for (int run = 0; run < RUNS; run ++) {
+    sequitur::Grammar g(k, -1, 1000000000, true);
+    t.start();
+    g.append(in.data(), in.size());
+    t.stop();
+  }
+  result("check", type, alphabet, k, 0, 0, n, t);
+}
+
+// Compressed files are of bytes, so the alphabet is at most 256.
+static void expand(const string &type, int alphabet)
+{
+  if (alphabet > 256) return;
+
+  vector<uint32_t> in = make_input(type, alphabet, n);
+  vector<uint8_t> bytes(in.begin(), in.end()), compressed, out;
+  sequitur::compress(bytes.data(), bytes.size(), compressed);
+
+  timing t;
+  for (int run = 0; run < RUNS; run ++) {
+    out.clear();
+    t.start();
+    sequitur::decompress(compressed.data(), compressed.size(), out);
+    t.stop();
+  }
+  if (out != bytes) {
+    fprintf(stderr, "sequitur_bench: expand gave back the wrong output\n");
+    exit(1);
+  }
+  result("expand", type, alphabet, 0, 0, 0, n, t);
+}
+
+// encode() the input in a context of the whole alphabet, then decode() it.
+static void encode_decode(const string &type, int alphabet)
+{
+  vector<uint32_t> in = make_input(type, alphabet, n);
+  vector<unsigned char> buffer(4 * n + 64);
+  timing te, td;
+  size_t length = 0;
+
+  for (int run = 0; run < RUNS; run ++) {
+    coder_state cs;
+    context *c = create_context(alphabet + 1, STATIC);
+    for (int i = 0; i < alphabet; i ++) install_symbol(c, i);
+
+    memset(&cs, 0, sizeof(cs));
+    bitio_memory_output(&cs.io, buffer.data(), buffer.size());
+    startoutputtingbits(&cs.io);
+    write_coder(&cs, ARITHMETIC_CODER, 0);
+    start_encode(&cs);
+    te.start();
+    for (size_t i = 0; i < n; i ++) encode(&cs, c, in[i]);
+    te.stop();
+    finish_encode(&cs);
+    doneoutputtingbits(&cs.io);
+    length = bitio_memory_length(&cs.io);
+    bitio_close(&cs.io);
+    free_context(c);
+  }
+
+  bool same = true;
+  for (int run = 0; run < RUNS; run ++) {
+    coder_state cs;
+    context *c = create_context(alphabet + 1, STATIC);
+    for (int i = 0; i < alphabet; i ++) install_symbol(c, i);
+
+    memset(&cs, 0, sizeof(cs));
+    bitio_memory_input(&cs.io, buffer.data(), length);
+    startinputtingbits(&cs.io);
+    read_coder(&cs);
+    start_decode(&cs);
+    td.start();
+    for (size_t i = 0; i < n; i ++) same &= decode(&cs, c) == (int) in[i];
+    td.stop();
+    finish_decode(&cs);
+    doneinputtingbits(&cs.io);
+    bitio_close(&cs.io);
+    free_context(c);
+  }
+  if (!same) {
+    fprintf(stderr, "sequitur_bench: decode gave back the wrong symbols\n");
+    exit(1);
+  }
+
+  if (wants("encode")) result("encode", type, alphabet, 0, 0, 0, n, te);
+  if (wants("decode")) result("decode", type, alphabet, 0, 0, 0, n, td);
+}
+
+static void arithmetic(const string &type, int alphabet, int coder,
+		       const char *coder_name)
+{
+  vector<uint32_t> in = make_input(type, alphabet, n);
+  vector<unsigned char> buffer(4 * n + 64);
+  timing t;
+
+  for (int run = 0; run < RUNS; run ++) {
+    coder_state cs;
+
+    memset(&cs, 0, sizeof(cs));
+    bitio_memory_output(&cs.io, buffer.data(), buffer.size());
+    startoutputtingbits(&cs.io);
+    write_coder(&cs, coder, 0);
+    start_encode(&cs);
+    t.start();
+    for (size_t i = 0; i < n; i ++)
+      arithmetic_encode(&cs, in[i], in[i] + 1, alphabet);
+    t.stop();
+    finish_encode(&cs);
+    doneoutputtingbits(&cs.io);
+    bitio_close(&cs.io);
+  }
+  result("arithmetic_encode", type, alphabet, 0, 0, coder_name, n, t);
+}
+
+
+int main(int argc, char **argv)
+{
+  for (int i = 1; i < argc; i ++)
+    if (argv[i][0] >= '0' && argv[i][0] <= '9') n = atol(argv[i]);
+    else wanted.push_back(argv[i]);
+
+  for (size_t i = 0; i < sizeof(inputs) / sizeof(*inputs); i ++) {
+    string input = inputs[i];
+
+    for (size_t a = 0; a < sizeof(alphabets) / sizeof(*alphabets); a ++) {
+      int alphabet = alphabets[a];
+
+      for (size_t j = 0; j < sizeof(ks) / sizeof(*ks); j ++) {
+	if (wants("find_digram"))
+	  for (size_t o = 0; o < sizeof(occupancies) / sizeof(*occupancies);
+	       o ++)
+	    benchmark::find_digram(input, alphabet, ks[j], occupancies[o]);
+	if (wants("check")) check(input, alphabet, ks[j]);
+      }
+
+      if (wants("expand")) expand(input, alphabet);
+      if (wants("encode") || wants("decode")) encode_decode(input, alphabet);
+      if (wants("arithmetic_encode")) {
+	arithmetic(input, alphabet, ARITHMETIC_CODER, "arith");
+	arithmetic(input, alphabet, RANGE_CODER, "range");
+	arithmetic(input, alphabet, RANS_CODER, "rans");
+      }
+    }
+  }
+
+  printf("%s\n]\n", first_result ? "[" : "");
+  return 0;
+}
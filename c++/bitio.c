@@ -37,6 +37,15 @@ part of each and every copy made of these files.
 ******************************************************************************/
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifdef _WIN32
+#  include <io.h>
+#  define getc_unlocked(f)	getc(f)
+#else
+#  include <unistd.h>
+#endif
 #include "bitio.h"
 
 #ifdef RCSID
@@ -45,34 +54,398 @@ static char
 #endif
 
 
-/* 
- * The following variables are supposedly local, but actually global so they
- * can be referenced by macro
+static void fail(const char *what)
+{
+    perror(what);
+    exit(1);
+}
+
+/* where bitio_error() goes on this thread, or 0 to exit */
+static THREAD_LOCAL jmp_buf *catcher;
+
+void bitio_error(const char *message)
+{
+    if (catcher)
+	longjmp(*catcher, 1);
+    fprintf(stderr, "%s\n", message);
+    exit(1);
+}
+
+jmp_buf *bitio_catch(jmp_buf *to)
+{
+    jmp_buf *before = catcher;
+    catcher = to;
+    return before;
+}
+
+/*
+ * Sources: each returns the next byte of the input, having filled the
+ * window again if it can, or EOF.
+ */
+static int file_source(bitio *io)
+{
+    return getc_unlocked(io->input);
+}
+
+static int fd_source(bitio *io)
+{
+    long n;
+
+    do
+	n = read(io->in_fd, io->in_window, io->in_window_size);
+    while (n < 0 && errno == EINTR);
+    if (n < 0)
+	fail("read");
+    if (n == 0)
+	return EOF;
+    io->in_next = io->in_window + 1;
+    io->in_end = io->in_window + n;
+    return io->in_window[0];
+}
+
+static int callback_source(bitio *io)
+{
+    size_t n = io->read(io->arg, io->in_window, io->in_window_size);
+
+    if (n == 0)
+	return EOF;
+    io->in_next = io->in_window + 1;
+    io->in_end = io->in_window + n;
+    return io->in_window[0];
+}
+
+static int memory_source(bitio *io)
+{
+    return EOF;
+}
+
+/*
+ * Sinks: each writes out the bytes in the window, and then byte x, if
+ * x is not EOF.
+ */
+static void file_sink(bitio *io, int x)
+{
+    size_t n = io->out_next - io->out_start;
+
+    if (n && fwrite(io->out_start, 1, n, io->output) != n)
+	fail("fwrite");
+    io->out_next = io->out_start;
+    if (x != EOF)
+	*io->out_next++ = x;
+}
+
+static void fd_sink(bitio *io, int x)
+{
+    const unsigned char *p = io->out_start;
+    long n;
+
+    while (p < io->out_next)
+    {
+	n = write(io->out_fd, p, io->out_next - p);
+	if (n < 0 && errno != EINTR)
+	    fail("write");
+	if (n > 0)
+	    p += n;
+    }
+    io->out_next = io->out_start;
+    if (x != EOF)
+	*io->out_next++ = x;
+}
+
+static void callback_sink(bitio *io, int x)
+{
+    if (io->out_next > io->out_start)
+	io->write(io->arg, io->out_start, io->out_next - io->out_start);
+    io->out_next = io->out_start;
+    if (x != EOF)
+	*io->out_next++ = x;
+}
+
+/* the memory is full: count the bytes that did not fit */
+static void memory_sink(bitio *io, int x)
+{
+    if (x != EOF)
+	io->out_lost++;
+}
+
+/*
+ * The source of the bytes given back with bitio_unread(), once they have
+ * been read: go back to the window and source they were read before.
+ */
+static int unread_source(bitio *io)
+{
+    io->in_next = io->saved_next;
+    io->in_end = io->saved_end;
+    io->source = io->saved_source;
+    return INPUT_CHAR(io);
+}
+
+/* read from 'source', after any bytes given back */
+static void set_source(bitio *io, int (*source)(bitio *io),
+		       const unsigned char *next, const unsigned char *end)
+{
+    if (io->source == unread_source)
+    {
+	io->saved_source = source;
+	io->saved_next = next;
+	io->saved_end = end;
+    }
+    else
+    {
+	io->source = source;
+	io->in_next = next;
+	io->in_end = end;
+    }
+}
+
+/* allocate the input window, of 'size' bytes */
+static void in_window(bitio *io, size_t size)
+{
+    if (io->in_window_size != size)
+    {
+	free(io->in_window);
+	io->in_window = (unsigned char *) malloc(size);
+	io->in_window_size = size;
+    }
+}
+
+/* write to 'sink', through a window of 'size' bytes of our own */
+static void set_sink(bitio *io, void (*sink)(bitio *io, int x), size_t size)
+{
+    if (io->sink)
+	io->sink(io, EOF);
+    if (io->out_window_size != size)
+    {
+	free(io->out_window);
+	io->out_window = (unsigned char *) malloc(size);
+	io->out_window_size = size;
+    }
+    io->sink = sink;
+    io->out_start = io->out_next = io->out_window;
+    io->out_end = io->out_window + size;
+}
+
+/*
+ *
+ * read bits from file 'in' and write them to file 'out', rather than
+ * stdin and stdout; 0 for either leaves it as it is
+ *
+ */
+void bitio_files(bitio *io, FILE *in, FILE *out)
+{
+    if (in)
+    {
+	io->input = in;
+	set_source(io, file_source, 0, 0);
+    }
+    if (out)
+    {
+	io->output = out;
+	set_sink(io, file_sink, BITIO_BUFFER);
+    }
+}
+
+/*
+ *
+ * read bits from file descriptor 'in' and write them to 'out'; -1 for
+ * either leaves it as it is
+ *
+ */
+void bitio_fds(bitio *io, int in, int out)
+{
+    if (in >= 0)
+    {
+	io->in_fd = in;
+	in_window(io, BITIO_FD_BUFFER);
+	set_source(io, fd_source, 0, 0);
+    }
+    if (out >= 0)
+    {
+	io->out_fd = out;
+	set_sink(io, fd_sink, BITIO_FD_BUFFER);
+    }
+}
+
+/*
+ *
+ * read bits from the 'size' bytes at 'bytes'
+ *
  */
+void bitio_memory_input(bitio *io, const void *bytes, size_t size)
+{
+    const unsigned char *p = (const unsigned char *) bytes;
 
-unsigned int	_bytes_input = 0;
-unsigned int	_bytes_output = 0;
+    set_source(io, memory_source, p, p + size);
+}
 
-int		_in_buffer;			/* I/O buffer */
-unsigned char	_in_bit_ptr = 0;		/* bits left in buffer */
-int		_in_garbage;			/* bytes read beyond eof */
+/*
+ *
+ * write bits to the 'size' bytes at 'buffer'; any that do not fit are
+ * counted (see bitio_memory_length()), and left out
+ *
+ */
+void bitio_memory_output(bitio *io, void *buffer, size_t size)
+{
+    if (io->sink)
+	io->sink(io, EOF);
+    io->sink = memory_sink;
+    io->out_start = io->out_next = (unsigned char *) buffer;
+    io->out_end = io->out_start + size;
+    io->out_lost = 0;
+}
 
-int		_out_buffer;			/* I/O buffer */
-int		_out_bits_to_go;		/* bits to fill buffer */
+/*
+ *
+ * read bits from what 'read' gives, and give those written to 'write';
+ * either may be 0 to leave it as it is
+ *
+ */
+void bitio_callbacks(bitio *io, bitio_reader *read, bitio_writer *write,
+		     void *arg)
+{
+    io->arg = arg;
+    if (read)
+    {
+	io->read = read;
+	in_window(io, BITIO_BUFFER);
+	set_source(io, callback_source, 0, 0);
+    }
+    if (write)
+    {
+	io->write = write;
+	set_sink(io, callback_sink, BITIO_BUFFER);
+    }
+}
 
-#ifndef FAST_BITIO
-int		_bitio_tmp;			/* Used by some of the */
-#endif						/* bitio.h macros */
+/*
+ * Number of bytes written to memory by bitio_memory_output(), counting
+ * those that did not fit: if it is more than the size of the memory, the
+ * output is incomplete.
+ */
+size_t bitio_memory_length(bitio *io)
+{
+    return io->out_next - io->out_start + io->out_lost;
+}
+
+/*
+ * Read up to 'size' bytes to 'buffer', returning how many there were.
+ */
+size_t bitio_read(bitio *io, void *buffer, size_t size)
+{
+    unsigned char *p = (unsigned char *) buffer;
+    size_t n = 0;
+    int c;
+
+    while (n < size && (c = INPUT_CHAR(io)) != EOF)
+    {
+	size_t left = io->in_end - io->in_next;
+
+	p[n++] = c;
+	if (left > size - n)
+	    left = size - n;
+	memcpy(p + n, io->in_next, left);
+	io->in_next += left;
+	n += left;
+    }
+    return n;
+}
+
+/*
+ * Write 'n' bytes.
+ */
+size_t bitio_write(bitio *io, const void *bytes, size_t n)
+{
+    const unsigned char *p = (const unsigned char *) bytes;
+    size_t left = n;
+
+    while (left > 0)
+    {
+	size_t room = io->out_end - io->out_next;
+
+	if (room == 0)
+	{
+	    OUTPUT_CHAR(io, *p);
+	    p++;
+	    left--;
+	    continue;
+	}
+	if (room > left)
+	    room = left;
+	memcpy(io->out_next, p, room);
+	io->out_next += room;
+	p += room;
+	left -= room;
+    }
+    return n;
+}
+
+/*
+ * Hand on the output written so far, and flush the file it is written to,
+ * if it is one, so that it can be read at once.
+ */
+void bitio_flush(bitio *io)
+{
+    if (io->sink)
+	io->sink(io, EOF);
+    if (io->sink == file_sink)
+	fflush(io->output);
+}
+
+/*
+ * Hand on the output written so far, and free the buffers: the bitio is
+ * zeroed, as it started out.
+ */
+void bitio_close(bitio *io)
+{
+    if (io->sink)
+	io->sink(io, EOF);
+    free(io->in_window);
+    free(io->out_window);
+    memset(io, 0, sizeof(*io));
+}
+
+/*
+ *
+ * give back up to 16 bytes, read from the input, to be read again before
+ * the rest of the input (and before any given back earlier and not yet
+ * read again)
+ *
+ */
+void bitio_unread(bitio *io, const unsigned char *bytes, int n)
+{
+    unsigned char kept[sizeof(io->unread)];
+    int i, left = 0;
+
+    if (io->source == unread_source)
+	while (io->in_next < io->in_end)
+	    kept[left++] = *io->in_next++;
+    else
+    {
+	io->saved_source = io->source;
+	io->saved_next = io->in_next;
+	io->saved_end = io->in_end;
+	io->source = unread_source;
+    }
+
+    for (i = 0; i < n && i < (int) sizeof(io->unread); i++)
+	io->unread[i] = bytes[i];
+    for (n = 0; n < left && i < (int) sizeof(io->unread); n++)
+	io->unread[i++] = kept[n];
+    io->in_next = io->unread;
+    io->in_end = io->unread + i;
+}
 
 /*
  *
  * initialize the bit output function
  *
  */
-void startoutputtingbits(void)
+void startoutputtingbits(bitio *io)
 {
-    _out_buffer = 0;
-    _out_bits_to_go = BYTE_SIZE;
+    if (!io->sink)
+	bitio_files(io, 0, stdout);
+    io->out_buffer = 0;
+    io->out_bits_to_go = BYTE_SIZE;
 }
 
 /*
@@ -80,24 +453,28 @@ void startoutputtingbits(void)
  * start the bit input function
  *
  */
-void startinputtingbits(void)
+void startinputtingbits(bitio *io)
 {
-    _in_garbage = 0;	/* Number of bytes read past end of file */
-    _in_bit_ptr = 0;	/* No valid bits yet in input buffer */
+    if (!io->source ||
+	(io->source == unread_source && !io->saved_source))
+	bitio_files(io, stdin, 0);
+    io->in_garbage = 0;	/* Number of bytes read past end of file */
+    io->in_bit_ptr = 0;	/* No valid bits yet in input buffer */
 }
 
 
 
 /*
  *
- * complete outputting bits
+ * complete outputting bits, and hand on the output
  *
  */
-void doneoutputtingbits(void)
+void doneoutputtingbits(bitio *io)
 {
-    if (_out_bits_to_go != BYTE_SIZE)
-	OUTPUT_BYTE(_out_buffer << _out_bits_to_go);
-    _out_bits_to_go = BYTE_SIZE;
+    if (io->out_bits_to_go != BYTE_SIZE)
+	OUTPUT_BYTE(io, io->out_buffer << io->out_bits_to_go);
+    io->out_bits_to_go = BYTE_SIZE;
+    io->sink(io, EOF);
 }
 
 /*
@@ -105,41 +482,40 @@ void doneoutputtingbits(void)
  * complete inputting bits
  *
  */
-void doneinputtingbits(void)
+void doneinputtingbits(bitio *io)
 {
-      _in_bit_ptr = 0;	      /* "Wipe" buffer (in case more input follows) */
+      io->in_bit_ptr = 0;     /* "Wipe" buffer (in case more input follows) */
 }
 
 /*
  * Number of bytes read with bitio functions.
  */
-int bitio_bytes_in(void)
+int bitio_bytes_in(bitio *io)
 {
-    return _bytes_input;
+    return io->bytes_input;
 }
 
 /*
  * Number of bytes written with bitio functions.
  */
-int bitio_bytes_out(void)
+int bitio_bytes_out(bitio *io)
 {
-    return _bytes_output;
+    return io->bytes_output;
 }
 
 /*
  * Return bit to input stream.
  * Only guaranteed to be able to backup by 1 bit.
  */
-void unget_bit(int bit)
+void unget_bit(bitio *io, int bit)
 {
-  _in_bit_ptr <<= 1;
+  io->in_bit_ptr <<= 1;
 
-  if (_in_bit_ptr == 0)
-	_in_bit_ptr = 1;
+  if (io->in_bit_ptr == 0)
+	io->in_bit_ptr = 1;
 
-  _in_buffer = _in_buffer & (_in_bit_ptr - 1);	/* Only keep bits still to */
-						/* to be read.		   */
+  io->in_buffer = io->in_buffer & (io->in_bit_ptr - 1);	/* Only keep bits */
+						/* still to be read.	  */
   if (bit)
-	_in_buffer |= _in_bit_ptr; 		/* Replace bit		   */
+	io->in_buffer |= io->in_bit_ptr; 	/* Replace bit		  */
 }
-
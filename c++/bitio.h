@@ -22,8 +22,26 @@ Copyright 1995 John Carpinelli and Wayne Salamonsen, All Rights Reserved.
 ******************************************************************************
  
   Bit and byte input output functions.
-  Input/Output to stdin/stdout 1 bit at a time.
+  Input/Output 1 bit at a time, to and from stdin/stdout, or the files
+  given to bitio_files(), file descriptors (bitio_fds()), memory
+  (bitio_memory_input(), bitio_memory_output()) or functions of the
+  caller's (bitio_callbacks()).  The state of a stream is kept in a bitio
+  struct, which the functions and macros are given, so that any number of
+  streams can be read and written at once, on one thread or several.  A
+  bitio starts out zeroed, and bitio_close() frees what it has allocated.
   Also byte i/o and fread/fwrite, so can keep a count of bytes read/written
+
+  Bytes are read from, and written to, a window of memory: the input up
+  to in_end, the output up to out_end.  The macros below only touch the
+  window; when it runs out, the source fills it again (or returns EOF at
+  the end of the input), and the sink takes the bytes written to it.  For
+  memory, the window is the caller's; otherwise it is a buffer of the
+  bitio's own, of BITIO_BUFFER bytes (BITIO_FD_BUFFER for a file
+  descriptor, so that writes are few and large).  Buffered output is only
+  handed on by doneoutputtingbits() and bitio_flush(), and when the window
+  is full.  A file is read a byte at a time (with getc_unlocked()), so that
+  no more of it is read than the stream takes, and whatever reads the file
+  next starts at the end of the stream.
    
   Once bit functions are used for either the input or output stream,
   byte based functions are NOT safe to use, unless a
@@ -35,52 +53,112 @@ Copyright 1995 John Carpinelli and Wayne Salamonsen, All Rights Reserved.
 #ifndef BITIO_H
 #define BITIO_H
 
+#include <stdio.h>
+#include <setjmp.h>
 
 #define		BYTE_SIZE		8
 
-/* As declared in bitio.c */
-extern unsigned int	_bytes_input, _bytes_output;
+#define		BITIO_BUFFER		(1 << 16)
+#define		BITIO_FD_BUFFER		(1 << 20)
+
+#ifndef THREAD_LOCAL
+#define		THREAD_LOCAL		__thread
+#endif
+
+typedef struct bitio bitio;
+
+/* The functions of bitio_callbacks(): 'read' puts up to 'size' bytes in
+ * 'buffer' and returns how many it did, 0 at the end of the input;
+ * 'write' takes 'n' bytes.  'arg' is that given to bitio_callbacks().
+ */
+typedef size_t	bitio_reader(void *arg, unsigned char *buffer, size_t size);
+typedef void	bitio_writer(void *arg, const unsigned char *bytes, size_t n);
+
+struct bitio {
+    /* The windows, and the functions that fill and empty them.  source()
+     * returns the next byte, or EOF; sink() takes byte x, or with EOF only
+     * the bytes in the window. */
+    const unsigned char	*in_next, *in_end;
+    int			(*source)(bitio *io);
+    unsigned char	*out_start, *out_next, *out_end;
+    void		(*sink)(bitio *io, int x);
+
+    FILE		*input;		/* bitio_files()	    */
+    FILE		*output;
+    int			in_fd, out_fd;	/* bitio_fds()		    */
+    bitio_reader	*read;		/* bitio_callbacks()	    */
+    bitio_writer	*write;
+    void		*arg;
+    unsigned char	*in_window;	/* buffers of our own	    */
+    unsigned char	*out_window;
+    size_t		in_window_size, out_window_size;
+    size_t		out_lost;	/* bytes not in the memory  */
 
-extern int 		_in_buffer;		/* Input buffer	 	    */
-extern unsigned char	_in_bit_ptr;		/* Input bit pointer 	    */
-extern int		_in_garbage;		/* # of bytes read past EOF */
+    unsigned int	bytes_input, bytes_output;
 
-extern int		_out_buffer;		/* Output buffer 	    */
-extern int		_out_bits_to_go;	/* Output bits in buffer    */
+    int			in_buffer;	/* Input buffer	 	    */
+    unsigned char	in_bit_ptr;	/* Input bit pointer 	    */
+    int			in_garbage;	/* # of bytes read past EOF */
 
-#ifndef FAST_BITIO
-extern int		_bitio_tmp;		/* Used by i/o macros to    */
-#endif						/* keep function ret values */
+    int			out_buffer;	/* Output buffer 	    */
+    int			out_bits_to_go;	/* Output bits in buffer    */
 
+    unsigned char	unread[16];	/* bytes given back with    */
+    const unsigned char	*saved_next,	/* bitio_unread(), and the  */
+			*saved_end;	/* window they are read     */
+    int			(*saved_source)(bitio *io);	/* before   */
+
+    int			tmp;		/* Used by i/o macros to    */
+					/* keep function ret values */
+};
 
 /*
- * OUTPUT_BIT(b)
+ * INPUT_CHAR(io)
  *
- * Outputs bit 'b' to stdout.  (Builds up a buffer, writing a byte
- * at a time.)
+ * Next byte of input, from the window if there are any left in it, or else
+ * from the source.
+ */
+#define INPUT_CHAR(io)							\
+    ((io)->in_next < (io)->in_end ? *(io)->in_next++ : (io)->source(io))
+
+/*
+ * OUTPUT_CHAR(io, x)
  *
+ * Write byte x to the window, or to the sink if the window is full.
  */
+#define OUTPUT_CHAR(io, x)							\
+    ((io)->out_next < (io)->out_end ? (void) (*(io)->out_next++ = (x)) :	\
+     (io)->sink(io, x))
+
 
-#define OUTPUT_BIT(b)				\
+/*
+ * OUTPUT_BIT(io, b)
+ *
+ * Outputs bit 'b' to the output of 'io'.  (Builds up a buffer, writing a
+ * byte at a time.)
+ *
+ */
+
+#define OUTPUT_BIT(io, b)			\
 do {						\
-   _out_buffer <<= 1;				\
+   (io)->out_buffer <<= 1;			\
    if (b)					\
-	_out_buffer |= 1;			\
-   _out_bits_to_go--;				\
-   if (_out_bits_to_go == 0)			\
+	(io)->out_buffer |= 1;			\
+   (io)->out_bits_to_go--;			\
+   if ((io)->out_bits_to_go == 0)		\
     {						\
-	OUTPUT_BYTE(_out_buffer);		\
-	_out_bits_to_go = BYTE_SIZE;		\
-        _out_buffer = 0;			\
+	OUTPUT_BYTE(io, (io)->out_buffer);	\
+	(io)->out_bits_to_go = BYTE_SIZE;	\
+        (io)->out_buffer = 0;			\
     }						\
 } while (0)
 
 /* 
- * ADD_NEXT_INPUT_BIT(v, garbage_bits)
+ * ADD_NEXT_INPUT_BIT(io, v, garbage_bits)
  * 
- * Returns a bit from stdin, by shifting 'v' left one bit, and adding
- * next bit as lsb (possibly reading upto garbage_bits extra bits beyond
- * valid input)
+ * Returns a bit from the input of 'io', by shifting 'v' left one bit, and
+ * adding next bit as lsb (possibly reading upto garbage_bits extra bits
+ * beyond valid input)
  * 
  * garbage_bits:  Number of bits (to nearest byte) past end of file to
  * be allowed to 'read' before printing an error message and halting.
@@ -89,33 +167,32 @@ do {						\
  * the code buffer full (although the actual bitvalue is not important)
  * at the end of decoding.
  * 
- * The buffer is not shifted, instead a bit flag (_in_bit_ptr) is moved
+ * The buffer is not shifted, instead a bit flag (in_bit_ptr) is moved
  * to point to the next bit that is to be read.  When it is zero, the
  * next byte is read, and it is reset to point to the msb.
  * 
  */
-#define ADD_NEXT_INPUT_BIT(v, garbage_bits)				\
+#define ADD_NEXT_INPUT_BIT(io, v, garbage_bits)				\
 do {									\
-    if (_in_bit_ptr == 0)						\
+    if ((io)->in_bit_ptr == 0)						\
     {									\
-	_in_buffer = getchar();						\
-	if (_in_buffer==EOF) 						\
+	(io)->in_buffer = INPUT_CHAR(io);				\
+	if ((io)->in_buffer==EOF) 					\
 	   {								\
-		_in_garbage++;						\
-		if ((_in_garbage-1)*8 >= garbage_bits)			\
+		(io)->in_garbage++;					\
+		if (((io)->in_garbage-1)*8 >= garbage_bits)		\
 		  {							\
-		    fprintf(stderr,"Bad input file - attempted "	\
-		 		   "read past end of file.\n");		\
-		    exit(1);						\
+		    bitio_error("Bad input file - attempted "		\
+				"read past end of file.");		\
 		  }							\
 	   }								\
 	else								\
-	   { _bytes_input++; }						\
-	_in_bit_ptr = (1<<(BYTE_SIZE-1));				\
+	   { (io)->bytes_input++; }					\
+	(io)->in_bit_ptr = (1<<(BYTE_SIZE-1));				\
     }									\
     v = (v << 1);							\
-    if (_in_buffer & _in_bit_ptr) v++;					\
-    _in_bit_ptr >>= 1;							\
+    if ((io)->in_buffer & (io)->in_bit_ptr) v++;			\
+    (io)->in_bit_ptr >>= 1;						\
 } while (0)
 
 
@@ -126,35 +203,57 @@ do {									\
  * speed slightly.
  */
 #ifdef FAST_BITIO
-#  define OUTPUT_BYTE(x)  putchar(x)
-#  define INPUT_BYTE()    getchar()
-#  define BITIO_FREAD(ptr, size, nitems)     fread(ptr, size, nitems, stdin)
-#  define BITIO_FWRITE(ptr, size, nitems)    fwrite(ptr, size, nitems, stdout)
+#  define OUTPUT_BYTE(io, x)  OUTPUT_CHAR(io, x)
+#  define INPUT_BYTE(io)      INPUT_CHAR(io)
+#  define BITIO_FREAD(io, ptr, size, nitems)				\
+	(bitio_read(io, ptr, (size) * (nitems)) / (size))
+#  define BITIO_FWRITE(io, ptr, size, nitems)				\
+	(bitio_write(io, ptr, (size) * (nitems)) / (size))
 #else
-#  define OUTPUT_BYTE(x)	( _bytes_output++, putchar(x) )
+#  define OUTPUT_BYTE(io, x)	( (io)->bytes_output++, OUTPUT_CHAR(io, x) )
 
-#  define INPUT_BYTE()	( _bitio_tmp = getchar(), 			\
-			  _bytes_input += (_bitio_tmp == EOF ) ? 0 : 1, \
-			  _bitio_tmp  )
+#  define INPUT_BYTE(io)	( (io)->tmp = INPUT_CHAR(io), 		\
+			  (io)->bytes_input += ((io)->tmp == EOF) ? 0 : 1, \
+			  (io)->tmp  )
 
-#  define BITIO_FREAD(ptr, size, nitems)			\
-	( _bitio_tmp = fread(ptr, size, nitems, stdin),		\
-	  _bytes_input += _bitio_tmp * size,			\
-	  _bitio_tmp )				/* Return result of fread */
+#  define BITIO_FREAD(io, ptr, size, nitems)				\
+	( (io)->tmp = bitio_read(io, ptr, (size) * (nitems)) / (size),	\
+	  (io)->bytes_input += (io)->tmp * size,			\
+	  (io)->tmp )				/* Return result of fread */
 
-#  define BITIO_FWRITE(ptr, size, nitems)				\
-	( _bitio_tmp = fwrite(ptr, size, nitems, stdout),	\
-	  _bytes_output += _bitio_tmp * size,			\
-	  _bitio_tmp )				/* Return result of fwrite */
+#  define BITIO_FWRITE(io, ptr, size, nitems)				\
+	( (io)->tmp = bitio_write(io, ptr, (size) * (nitems)) / (size),	\
+	  (io)->bytes_output += (io)->tmp * size,			\
+	  (io)->tmp )				/* Return result of fwrite */
 #endif
 
-void startoutputtingbits(void);
-void startinputtingbits(void);
-void doneoutputtingbits(void);
-void doneinputtingbits(void);
-int bitio_bytes_in(void);
-int bitio_bytes_out(void);
+void bitio_files(bitio *io, FILE *in, FILE *out);
+void bitio_fds(bitio *io, int in, int out);
+void bitio_memory_input(bitio *io, const void *bytes, size_t size);
+void bitio_memory_output(bitio *io, void *buffer, size_t size);
+void bitio_callbacks(bitio *io, bitio_reader *read, bitio_writer *write,
+		     void *arg);
+size_t bitio_memory_length(bitio *io);
+size_t bitio_read(bitio *io, void *buffer, size_t size);
+size_t bitio_write(bitio *io, const void *bytes, size_t n);
+void bitio_flush(bitio *io);
+void bitio_close(bitio *io);
+void bitio_unread(bitio *io, const unsigned char *bytes, int n);
+void startoutputtingbits(bitio *io);
+void startinputtingbits(bitio *io);
+void doneoutputtingbits(bitio *io);
+void doneinputtingbits(bitio *io);
+int bitio_bytes_in(bitio *io);
+int bitio_bytes_out(bitio *io);
+
+void unget_bit(bitio *io, int bit);
 
-void unget_bit(int bit);
+/* Stop on input that cannot be decoded, with 'message': by exit(1), once
+ * it is printed, or by longjmp() to the jmp_buf that bitio_catch() last
+ * gave this thread, if any, so that a library call can return instead
+ * (see decompress() in compress.h).  bitio_catch() returns the jmp_buf it
+ * replaces, or 0. */
+void bitio_error(const char *message);
+jmp_buf *bitio_catch(jmp_buf *to);
 
 #endif		/* ifndef bitio_h */
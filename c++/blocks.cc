@@ -0,0 +1,450 @@
+/****************************************************************************
+
+ blocks.cc - Module containing the block container written with -b: the
+             input is cut into blocks of a fixed number of symbols, and each
+             block is compressed on its own, so that blocks can be
+             compressed, and decompressed, by a pool of threads (-j).
+
+ Format of the container
+
+     4 bytes    "SQBK"
+     1 byte     version, 3
+     for each block,
+       8 bytes  the size of the block in bytes
+       8 bytes  the number of symbols compressed in it
+       the block
+     16 bytes   of zeroes, where the next block would start
+     the block table: for each block,
+       8 bytes  where its size is, from the start of the container
+       8 bytes  the number of symbols compressed in it
+     8 bytes    where the block table is, from the start of the container
+
+ Numbers are little-endian. Each block is a compressed file of its own,
+ as sequitur -c writes, so it carries its own least and greatest terminal
+ and longest rule. sequitur -u tells a container from a plain compressed
+ file by the first four bytes.
+
+ Blocks are written as soon as they, and those before them, have been
+ compressed, and are read one at a time as threads are free to
+ decompress them, so that neither end holds more than a few blocks at
+ once. The block table is the index for --range: if the input can seek,
+ the table is read from the end, the block the range starts in is found
+ by a binary search of it, and reading starts there. From a pipe, the
+ size before each block is used to skip it instead. Either way, no block
+ after the range is read.
+
+ Version 2 is the same without the block table. Version 1 had, after the
+ version, the number of blocks (4 bytes) and a table of the sizes and
+ symbol counts of all of them, and then the blocks with nothing between
+ them. Both are still read.
+
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "classes.h"
+
+extern int k, delimiter, quiet, threads;
+extern long memory_to_use;
+
+int read_symbols(uint32_t *buffer, int size);
+void compress_grammar(sequitur::Grammar &g, vector<uint8_t> &out,
+		      bool empty),
+  uncompress_memory(const void *in, size_t size, vector<uint8_t> &out,
+		    uint64_t offset, uint64_t length),
+  uncompress_unread(const unsigned char *bytes, int n);
+
+static const char magic[] = "SQBK";
+enum { VERSION = 3,
+       HEADER = 5,             // bytes before the first block
+       ENTRY = 16,             // bytes before each block, or in the table
+       ENTRIES_VERSION = 2,    // with no block table at the end
+       TABLE_VERSION = 1 };    // with a table of the blocks up front
+
+static void put_number(string &s, uint64_t x, int bytes)
+{
+  for (int i = 0; i < bytes; i ++) s += char(x >> (8 * i));
+}
+
+static uint64_t get_number(const unsigned char *p, int bytes)
+{
+  uint64_t x = 0;
+  for (int i = 0; i < bytes; i ++) x |= uint64_t(p[i]) << (8 * i);
+  return x;
+}
+
+
+// **************************************************************************
+// Compression
+// **************************************************************************
+
+// Threads take blocks of the input in turn, and the main thread writes them
+// out in order. As in decompression, threads do not get more than two
+// blocks per thread ahead of the output.
+
+struct block {
+  uint64_t symbols;            // number of input symbols
+  vector<uint8_t> data;        // compressed
+  bool done;
+};
+
+// blocks read from the input and not yet written; a deque, so that
+// threads can fill in their blocks while others are added
+static deque<block> blocks;
+static size_t first_block = 0;    // number of blocks[0]
+static bool input_ended = false;
+static mutex input_lock, block_lock;
+// These, and the blocks being decompressed, are never destroyed: a thread
+// that finds a block corrupt exits the program while the others go on, and
+// destroying a condition variable waits for the threads waiting on it.
+static condition_variable &block_done = *new condition_variable;
+
+// Form the grammar of n symbols and compress it to 'out'.
+static void compress_block(const uint32_t *input, size_t n,
+			   vector<uint8_t> &out)
+{
+  sequitur::Grammar g(k, delimiter, memory_to_use / threads, quiet);
+  g.append(input, n);
+  compress_grammar(g, out, false);
+}
+
+// Take blocks from the input, one at a time, and compress them.
+static void compress_blocks_thread(int block_size)
+{
+  vector<uint32_t> input(block_size);
+
+  while (1) {
+    size_t i;
+    int n;
+    {
+      lock_guard<mutex> in(input_lock);
+      {
+	unique_lock<mutex> lock(block_lock);
+	while (!input_ended && blocks.size() >= 2 * size_t(threads))
+	  block_done.wait(lock);
+	if (input_ended) return;
+      }
+      n = read_symbols(&input[0], block_size);
+
+      lock_guard<mutex> lock(block_lock);
+      if (n == 0) {
+	input_ended = true;
+	block_done.notify_all();
+	return;
+      }
+      i = first_block + blocks.size();
+      blocks.push_back(block());
+      blocks.back().symbols = n;
+      blocks.back().done = false;
+    }
+
+    vector<uint8_t> out;
+    compress_block(&input[0], n, out);
+
+    lock_guard<mutex> lock(block_lock);
+    blocks[i - first_block].data.swap(out);
+    blocks[i - first_block].done = true;
+    block_done.notify_all();
+  }
+}
+
+// Compress the input in blocks of block_size symbols, on 'threads' threads,
+// and write the container to standard output.
+void compress_blocks(int block_size)
+{
+  string header(magic, 4);
+  put_number(header, VERSION, 1);
+  fwrite(header.data(), 1, header.size(), stdout);
+
+  vector<thread> workers;
+  for (int t = 0; t < threads; t ++)
+    workers.push_back(thread(compress_blocks_thread, block_size));
+
+  // the block table, and where the next block goes
+  string index;
+  uint64_t at = HEADER;
+
+  while (1) {
+    unique_lock<mutex> lock(block_lock);
+    while (!(blocks.empty() ? input_ended : blocks.front().done))
+      block_done.wait(lock);
+    if (blocks.empty()) break;
+    block b;
+    b.symbols = blocks.front().symbols;
+    b.data.swap(blocks.front().data);
+    blocks.pop_front();
+    first_block ++;
+    block_done.notify_all();
+    lock.unlock();
+
+    string entry;
+    put_number(entry, b.data.size(), 8);
+    put_number(entry, b.symbols, 8);
+    fwrite(entry.data(), 1, entry.size(), stdout);
+    fwrite(b.data.data(), 1, b.data.size(), stdout);
+
+    put_number(index, at, 8);
+    put_number(index, b.symbols, 8);
+    at += ENTRY + b.data.size();
+  }
+
+  for (int t = 0; t < threads; t ++) workers[t].join();
+
+  string end(ENTRY, '\0');
+  put_number(index, at + ENTRY, 8);
+  fwrite(end.data(), 1, end.size(), stdout);
+  fwrite(index.data(), 1, index.size(), stdout);
+  fflush(stdout);
+}
+
+
+// **************************************************************************
+// Decompression
+//    Threads read the blocks in turn, and the main thread writes them out
+//    in order. Threads do not get more than two blocks per thread ahead of
+//    the output, so that only a few blocks are held at once.
+// **************************************************************************
+
+struct part {
+  vector<uint8_t> out;         // decompressed
+  bool done;
+};
+
+static deque<part> &parts = *new deque<part>;  // read, not yet written
+static vector<unsigned char> table;  // of a version 1 container
+static size_t next_entry = 0;  // in table
+static uint64_t first_symbol = 0, range_offset, range_end;
+static int version;
+// where the size of the next block is, from the start of the container,
+// and the number of blocks before it
+static uint64_t next_at = HEADER, blocks_before = 0;
+static bool broken = false;    // the container is cut short, or corrupt
+
+static void corrupt()
+{
+  cerr << "sequitur: corrupt block container" << endl;
+  exit(1);
+}
+
+// Read n bytes, or skip them if 'to' is 0; false if the input ends first.
+static bool read_input(unsigned char *to, uint64_t n)
+{
+  if (to) return fread(to, 1, n, stdin) == n;
+  if (n && fseeko(stdin, n, SEEK_CUR) == 0) return true;
+
+  vector<unsigned char> ignored(1 << 16);
+  while (n > 0) {
+    size_t m = min(n, uint64_t(ignored.size()));
+    if (fread(&ignored[0], 1, m, stdin) != m) return false;
+    n -= m;
+  }
+  return true;
+}
+
+// Find the block the range starts in from the block table at the end of a
+// container that starts at 'start', and seek to it. An input that cannot
+// seek (a negative 'start') is left where it was, after the header.
+static void seek_range(off_t start)
+{
+  unsigned char number[8];
+  off_t end;
+  if (start < 0) return;
+  if (fseeko(stdin, -8, SEEK_END) != 0 || (end = ftello(stdin)) < 0) {
+    fseeko(stdin, start + HEADER, SEEK_SET);
+    return;
+  }
+  if (fread(number, 1, 8, stdin) != 8) corrupt();
+
+  uint64_t at = get_number(number, 8);
+  if (at < HEADER + ENTRY || at > uint64_t(end - start) ||
+      (end - start - at) % ENTRY != 0)
+    corrupt();
+  vector<unsigned char> index(end - start - at);
+  if (fseeko(stdin, start + at, SEEK_SET) != 0 ||
+      (!index.empty() && !read_input(&index[0], index.size())))
+    corrupt();
+
+  // the first symbol of each block, and of where the next would be
+  size_t blocks = index.size() / ENTRY;
+  vector<uint64_t> first(blocks + 1, 0);
+  for (size_t i = 0; i < blocks; i ++) {
+    first[i + 1] = first[i] + get_number(&index[i * ENTRY + 8], 8);
+    if (first[i + 1] < first[i]) corrupt();
+  }
+
+  // the last block that starts at or before the range, if any does not end
+  // before it; otherwise the end, where the zeroes are
+  size_t i = upper_bound(first.begin(), first.end(), range_offset)
+    - first.begin() - 1;
+  at = i < blocks ? get_number(&index[i * ENTRY], 8) : at - ENTRY;
+  if (at < HEADER || fseeko(stdin, start + at, SEEK_SET) != 0) corrupt();
+  first_symbol = first[i];
+  next_at = at;
+  blocks_before = i;
+}
+
+// Read the block table after the zeroes at the end of a container that has
+// one, and check where it says it is. It is not needed then, but it is
+// missing if the container was cut short.
+static bool read_table_end()
+{
+  vector<unsigned char> index(blocks_before * ENTRY + 8);
+  return read_input(&index[0], index.size()) &&
+    get_number(&index[index.size() - 8], 8) == next_at + ENTRY;
+}
+
+// Read the next block that holds part of the range into 'data', with the
+// symbols of it to leave out and to write; false once there are no more,
+// or if the container is cut short ('broken'). This is called by the
+// threads, which leave it to the main thread to stop once the blocks
+// before have been written.
+static bool read_block(vector<unsigned char> &data, uint64_t &skip,
+		       uint64_t &length)
+{
+  while (first_symbol < range_end) {
+    unsigned char entry[ENTRY];
+    if (!table.empty()) {
+      if (next_entry == table.size()) return false;
+      memcpy(entry, &table[next_entry], ENTRY);
+      next_entry += ENTRY;
+    }
+    else if (!read_input(entry, ENTRY)) return !(broken = true);
+
+    uint64_t bytes = get_number(entry, 8);
+    uint64_t symbols = get_number(entry + 8, 8);
+    uint64_t next_symbol = first_symbol + symbols;
+    if (bytes == 0 && table.empty())
+      return version == VERSION && !read_table_end() ? !(broken = true) : false;
+    if (next_symbol < first_symbol) return !(broken = true);
+
+    if (next_symbol <= range_offset) {
+      if (!read_input(0, bytes)) return !(broken = true);
+    }
+    else {
+      // a megabyte at a time, so that a wrong size cannot take more memory
+      // than there is input
+      data.clear();
+      for (uint64_t left = bytes; left; ) {
+	size_t n = min(left, uint64_t(1 << 20)), at = data.size();
+	data.resize(at + n);
+	if (!read_input(&data[at], n)) return !(broken = true);
+	left -= n;
+      }
+      skip = range_offset > first_symbol ? range_offset - first_symbol : 0;
+      length = min(range_end, next_symbol) - first_symbol - skip;
+      first_symbol = next_symbol;
+      next_at += ENTRY + bytes;
+      blocks_before ++;
+      return true;
+    }
+    first_symbol = next_symbol;
+    next_at += ENTRY + bytes;
+    blocks_before ++;
+  }
+  return false;
+}
+
+static void uncompress_blocks_thread()
+{
+  while (1) {
+    size_t i;
+    vector<unsigned char> data;
+    uint64_t skip, length;
+    {
+      lock_guard<mutex> in(input_lock);
+      {
+	unique_lock<mutex> lock(block_lock);
+	while (!input_ended && parts.size() >= 2 * size_t(threads))
+	  block_done.wait(lock);
+	if (input_ended) return;
+      }
+      bool got = read_block(data, skip, length);
+
+      lock_guard<mutex> lock(block_lock);
+      if (!got) {
+	input_ended = true;
+	block_done.notify_all();
+	return;
+      }
+      i = first_block + parts.size();
+      parts.push_back(part());
+      parts.back().done = false;
+    }
+
+    vector<uint8_t> out;
+    uncompress_memory(data.data(), data.size(), out, skip, length);
+
+    lock_guard<mutex> lock(block_lock);
+    parts[i - first_block].out.swap(out);
+    parts[i - first_block].done = true;
+    block_done.notify_all();
+  }
+}
+
+// If standard input is a container, decompress symbols 'offset' to
+// 'offset' + 'length' of it and return true; otherwise give back the bytes
+// read to tell, and return false.
+bool uncompress_blocks(uint64_t offset, uint64_t length)
+{
+  unsigned char header[HEADER + 4];
+
+  size_t n = fread(header, 1, 4, stdin);
+  if (n < 4 || memcmp(header, magic, 4) != 0) {
+    uncompress_unread(header, n);
+    return false;
+  }
+  if (fread(header + 4, 1, HEADER - 4, stdin) != HEADER - 4) corrupt();
+
+  range_offset = offset;
+  range_end = offset + length;
+  if (range_end < offset) range_end = UINT64_MAX;
+
+  version = header[4];
+  if (version == TABLE_VERSION) {
+    if (fread(header + HEADER, 1, 4, stdin) != 4) corrupt();
+    table.resize(get_number(header + HEADER, 4) * ENTRY);
+    if (!table.empty() && !read_input(&table[0], table.size())) corrupt();
+  }
+  else if (version == VERSION) {
+    off_t at = ftello(stdin);
+    if (offset > 0) seek_range(at < 0 ? at : at - HEADER);
+  }
+  else if (version != ENTRIES_VERSION) {
+    cerr << "sequitur: block container of unknown version " << version
+	 << endl;
+    exit(1);
+  }
+
+  vector<thread> workers;
+  for (int t = 0; t < threads; t ++)
+    workers.push_back(thread(uncompress_blocks_thread));
+
+  while (1) {
+    unique_lock<mutex> lock(block_lock);
+    while (!(parts.empty() ? input_ended : parts.front().done))
+      block_done.wait(lock);
+    if (parts.empty()) break;
+    vector<uint8_t> out;
+    out.swap(parts.front().out);
+    parts.pop_front();
+    first_block ++;
+    block_done.notify_all();
+    lock.unlock();
+
+    fwrite(out.data(), 1, out.size(), stdout);
+  }
+
+  for (int t = 0; t < threads; t ++) workers[t].join();
+  fflush(stdout);
+  if (broken) corrupt();
+  return true;
+}
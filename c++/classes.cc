@@ -1,36 +1,386 @@
 /****************************************************************************
 
  classes.cc - Module containing (part of the) methods of 'rules' and 'symbols'
-              classes, and functions for working with the hash table of digrams
-              printing out the grammar.
+              classes, and the methods of 'Grammar': adding symbols to the
+              grammar and working with the hash table of digrams.
 
  Notes:
     For the rest of 'symbols' and 'rules' methods, see classes.h .
+    The functions printing out the grammar are in sequitur.cc .
 
  ****************************************************************************/
 
 #include "classes.h"
-#include <ctype.h>
-#include <math.h>
+#include <unordered_map>
+#include <vector>
 
-extern int num_rules, delimiter, do_uncompress;
+#ifdef PLATFORM_UNIX
+#include <sys/mman.h>
+#endif
+
+using sequitur::Grammar;
+using sequitur::current;
+
+thread_local Grammar *sequitur::current = 0;
+
+enum { HUGE_PAGE = 1 << 21 };
+
+// Get 'bytes' bytes of zeroed memory for the hash table or the nodes of the
+// grammar, or 0 if there is not enough. On Unix they are mapped straight
+// from the system, so nothing is done up front: the kernel supplies zeroed
+// pages as they are first touched. Large regions are also marked for
+// transparent huge pages, which cuts the TLB misses of random accesses.
+static void *get_memory(size_t bytes)
+{
+#ifdef PLATFORM_UNIX
+  void *p = mmap(0, bytes, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED) return 0;
+#ifdef MADV_HUGEPAGE
+  if (bytes >= HUGE_PAGE) madvise(p, bytes, MADV_HUGEPAGE);
+#endif
+  return p;
+#else
+  return calloc(bytes, 1);
+#endif
+}
+
+static void free_memory(void *p, size_t bytes)
+{
+#ifdef PLATFORM_UNIX
+  munmap(p, bytes);
+#else
+  free(p);
+#endif
+}
+
+// Get a new block and allocate an object of size class 'c' from it. The
+// first word of each block links it to the previous one.
+void *node_arena::refill(int c)
+{
+  char *b = (char *) get_memory(BLOCK_SIZE);
+  if (b == 0) {
+    cerr << "sequitur: out of memory" << endl;
+    exit(1);
+  }
+  *(void **) b = blocks;
+  blocks = b;
+
+  block_next = b + GRANULE;
+  block_end = b + BLOCK_SIZE;
+
+  void *p = block_next;
+  block_next += (c + 1) * GRANULE;
+  return p;
+}
+
+// Free all blocks, and with them every node allocated so far.
+void node_arena::release_all()
+{
+  while (blocks) {
+    void *next = *(void **) blocks;
+    free_memory(blocks, BLOCK_SIZE);
+    blocks = next;
+  }
+  for (int c = 0; c < CLASSES; c ++) free_list[c] = 0;
+  block_next = block_end = 0;
+}
+
+#ifdef COMPACT_NODES
+
+#ifndef PLATFORM_UNIX
+#error COMPACT_NODES needs mmap(), compile with PLATFORM_UNIX
+#endif
+
+// a symbol stores a rule index shifted left by two bits
+template <> const uint32_t node_pool<symbols>::capacity = 0xffffffff;
+template <> const uint32_t node_pool<rules>::capacity = 1 << 30;
+
+// Reserve address space for the largest array an index can address; pages
+// are only backed by memory once they are written to.
+template <class T> void node_pool<T>::grow()
+{
+  if (base == 0) {
+    void *b = get_memory(size_t(capacity) * sizeof(T));
+    if (b) {
+      base = (T *) b;
+      top = 1;
+      limit = capacity;
+      return;
+    }
+  }
+  cerr << "sequitur: out of memory" << endl;
+  exit(1);
+}
+
+template <class T> void node_pool<T>::release_all()
+{
+  if (base) free_memory(base, size_t(limit) * sizeof(T));
+  base = 0;
+  top = limit = free_list = 0;
+}
+
+template class node_pool<symbols>;
+template class node_pool<rules>;
+
+#endif
+
+// ***************************************************************************
+// Grammar::Grammar(int k, int delimiter, long memory_to_use, bool quiet)
+//    Start an empty grammar, and make it the grammar of the calling thread.
+// ***************************************************************************
+Grammar::Grammar(int k, int d, long m, bool q)
+{
+  assert(k >= 2);
+  K = k - 1;
+  delimiter = d;
+  memory_to_use = m;
+  quiet = q;
+
+  num_rules = num_symbols = 0;
+  min_terminal = max_terminal = 0;
+  max_rule_len = 2;
+  length = 0;
+
+  table.buckets = old_table.buckets = 0;
+  table.size = old_table.size = 0;
+  moved_from = moved = 0;
+  rehash_wanted = warned = false;
+  recent_lookups = recent_probes = 0;
+  bucket_entries = bucket_bytes = slots_offset = 0;
+  table_size = occupied = lookups = collisions = tag_misses = rehashes = 0;
+  memset(probe_lengths, 0, sizeof(probe_lengths));
+
+  select();
+  S = new rules;
+}
+
+// Free every symbol and rule of the grammar at once, and the hash table.
+Grammar::~Grammar()
+{
+#ifdef COMPACT_NODES
+  symbol_nodes.release_all();
+  rule_nodes.release_all();
+#else
+  nodes.release_all();
+#endif
+  if (table.buckets) free_memory(table.buckets, table.size * bucket_bytes);
+  if (old_table.buckets)
+    free_memory(old_table.buckets, old_table.size * bucket_bytes);
+  if (current == this) current = 0;
+}
+
+// ***************************************************************************
+// Grammar::append(const uint32_t *syms, size_t n)
+//    Append each of the n symbols to the end of rule S, and enforce the
+//    constraints. The hash table is given the chance to grow in between.
+// ***************************************************************************
+void Grammar::append(const uint32_t *syms, size_t n)
+{
+  select();
+
+  for (size_t j = 0; j < n; j ++) {
+    int i = syms[j];
+
+    if (length ++ == 0) min_terminal = max_terminal = i;
+    else if (i < min_terminal) min_terminal = i;
+    else if (i > max_terminal) max_terminal = i;
+
+    push(new symbols(syms[j]));
+  }
+}
+
+void Grammar::push(symbols *s)
+{
+  S->last()->insert_after(s);
+  S->last()->prev()->check();
+  rehash_step();
+}
+
+// Describe rule r, and the rules it uses that are not described yet, in
+// 'bodies': the right hand of each rule is listed after those of the rules
+// in it, and numbered (with rules::index()) by its place in the list, from
+// one. Terminals are listed as their value times two plus one, and
+// non-terminals as the number of their rule times two.
+static void list_rules(rules *r, vector<vector<ulong> > &bodies)
+{
+  vector<ulong> body;
+
+  for (symbols *p = r->first(); !p->is_guard(); p = p->next())
+    if (p->non_terminal()) {
+      if (p->rule()->index() == 0) list_rules(p->rule(), bodies);
+      body.push_back(p->rule()->index() * 2);
+    }
+    else body.push_back(p->value() * 2 + 1);
+
+  bodies.push_back(body);
+  r->index(bodies.size());
+}
+
+// hash of a right hand listed by list_rules()
+struct body_hash {
+  size_t operator () (const vector<ulong> &body) const {
+    unsigned long long h = body.size();
+    for (size_t i = 0; i < body.size(); i ++)
+      h = (h ^ body[i]) * 0x9e3779b97f4a7c15ULL;
+    return h ^ (h >> 29);
+  }
+};
+
+// ***************************************************************************
+// Grammar::merge(Grammar *parts[], int n)
+//    Append the sequences of n other grammars, each built from the piece of
+//    the input that follows the one before, to this grammar. The rules of
+//    all of them are copied first, each distinct right hand once, and their
+//    digrams put in the hash table. Then the symbols of their main rules are
+//    appended one by one, checking the digrams as they are formed, so that
+//    repetitions across the pieces still form rules.
+//
+//    The other grammars must not be used by any other thread meanwhile;
+//    their rules are numbered, and they are best deleted afterwards.
+// ***************************************************************************
+void Grammar::merge(Grammar *parts[], int n)
+{
+  vector<rules *> copies;                 // rules copied so far
+  // their right hands, as listed by list_rules(), with non-terminals
+  // numbered by their place in 'copies'
+  unordered_map<vector<ulong>, int, body_hash> copied;
+  vector<vector<ulong> > sequences(n);
+
+  for (int j = 0; j < n; j ++) {
+    Grammar *part = parts[j];
+    vector<vector<ulong> > bodies;
+    vector<int> number(1);                // from part's numbering to ours
+
+    part->select();
+    list_rules(part->S, bodies);
+    select();
+
+    if (part->length) {
+      if (length == 0) {
+	min_terminal = part->min_terminal;
+	max_terminal = part->max_terminal;
+      }
+      if (part->min_terminal < min_terminal) min_terminal = part->min_terminal;
+      if (part->max_terminal > max_terminal) max_terminal = part->max_terminal;
+      length += part->length;
+    }
+
+    for (size_t i = 0; i < bodies.size(); i ++) {
+      vector<ulong> &body = bodies[i];
+      size_t k;
+
+      for (k = 0; k < body.size(); k ++)
+	if (body[k] % 2 == 0) body[k] = number[body[k] / 2] * 2;
+
+      // the main rule is last
+      if (i == bodies.size() - 1) {
+	sequences[j].swap(body);
+	break;
+      }
+
+      unordered_map<vector<ulong>, int, body_hash>::iterator c =
+	copied.find(body);
+      if (c != copied.end()) {
+	number.push_back(c->second);
+	continue;
+      }
+
+      rules *r = new rules;
+      for (k = 0; k < body.size(); k ++)
+	if (body[k] % 2) r->last()->insert_after(new symbols(body[k] / 2));
+	else r->last()->insert_after(new symbols(copies[body[k] / 2]));
+
+      for (symbols *s = r->first(); !s->next()->is_guard(); s = s->next()) {
+	symbols **x = find_digram(s);
+	if (!x) continue;
+	for (int m = 0; m < K; m ++)
+	  if (x[m] == s) break;
+	  else if (ulong(x[m]) <= 1) {
+	    x[m] = s;
+	    occupied ++;
+	    break;
+	  }
+      }
+      rehash_step();
+
+      if (r->length() > max_rule_len) max_rule_len = r->length();
+
+      number.push_back(copies.size());
+      copied[body] = copies.size();
+      copies.push_back(r);
+    }
+  }
+
+  // a rule may be used in the sequence of one part only, and its uses in
+  // another are appended later, so none of them can be expanded until the
+  // end: each counts one use more in the meantime
+  size_t i;
+  for (i = 0; i < copies.size(); i ++) copies[i]->reuse();
+
+  for (int j = 0; j < n; j ++)
+    for (size_t k = 0; k < sequences[j].size(); k ++) {
+      ulong c = sequences[j][k];
+      if (c % 2) push(new symbols(c / 2));
+      else push(new symbols(copies[c / 2]));
+    }
+
+  for (i = 0; i < copies.size(); i ++) copies[i]->deuse();
+  expand_rules_used_once();
+}
+
+// Expand every rule that is used only once, walking the grammar from S.
+// A rule is copied once for each part it appears in, and its uses may
+// have been taken into rules formed across parts since.
+void Grammar::expand_rules_used_once()
+{
+  vector<rules *> todo(1, S), seen;
+
+  while (!todo.empty()) {
+    rules *r = todo.back();
+    todo.pop_back();
+
+    for (symbols *p = r->first(); !p->is_guard(); p = p->next()) {
+      if (!p->non_terminal()) continue;
+      rules *q = p->rule();
+
+      // expand() does nothing to a symbol next to a delimiter
+      if (q->freq() == 1 && find_digram(p)) {
+	// carry on from the first symbol put in its place (when that is the
+	// first of r, the guard of r may have been replaced, see expand())
+	symbols *left = p->prev();
+	bool at_start = left->is_guard();
+	p->expand();
+	rehash_step();
+	p = at_start ? r->first()->prev() : left;
+      }
+      else if (q->index() == 0) {
+	q->index(1);
+	seen.push_back(q);
+	todo.push_back(q);
+      }
+    }
+  }
+
+  for (size_t i = 0; i < seen.size(); i ++) seen[i]->index(0);
+}
 
 rules::rules() {
-  num_rules ++;
-  guard = new symbols(this);
-  guard->point_to_self();
-  count = number = Usage = 0;
+  current->num_rules ++;
+  guard = symbols::ref(new symbols(this));
+  symbols::ptr(guard)->point_to_self();
+  count = number = Usage = Length = 0;
 }
 
 rules::~rules() {
-  num_rules --;
-  delete guard;
+  current->num_rules --;
+  delete symbols::ptr(guard);
 }
 
 // pointer to first symbol of rule's right hand
-symbols *rules::first() { return guard->next(); }
+symbols *rules::first() { return symbols::ptr(guard)->next(); }
 // pointer to  last symbol of rule's right hand
-symbols *rules::last()  { return guard->prev(); }
+symbols *rules::last()  { return symbols::ptr(guard)->prev(); }
 
 // **************************************************************************
 // symbols::check()
@@ -41,13 +391,15 @@ symbols *rules::last()  { return guard->prev(); }
 //    0 : did not change the grammar (there was no violation of contraints)
 //    1 : did change the grammar (there were violations of contraints)
 //
-// Global variables used
+// Grammar variables used
 //    K (minimum number of times a digram must occur to form rule)
 // **************************************************************************
 int symbols::check() {
-  if (is_guard() || n->is_guard()) return 0;
+  if (is_guard() || next()->is_guard()) return 0;
 
-  symbols **x = find_digram(this);
+  Grammar *G = current;
+  int K = G->K;
+  symbols **x = G->find_digram(this);
   // if either symbol of the digram is a delimiter -> do nothing
   if (!x) return 0;
 
@@ -57,7 +409,7 @@ int symbols::check() {
   for (i = 0; i < K; i ++)
     if (ulong(x[i]) <= 1) {
       x[i] = this;
-      occupied ++;
+      G->occupied ++;
       return 0;
     }
 
@@ -121,8 +473,11 @@ int symbols::check() {
     //    y[i] = (symbols *) 1; // should be x
   }
 
+  // the substitutions above may have moved the digram's entry, so look
+  // it up again rather than writing through the old slot pointer
+  x = G->find_digram(r->first());
   x[0] = r->first();
-  occupied ++;
+  G->occupied ++;
 
   substitute(r);
 
@@ -140,40 +495,43 @@ int symbols::check() {
 // symbols::expand()
 //    This symbol is the last reference to its rule. It is deleted, and the
 //    contents of the rule substituted in its place.
+//
+//    The symbols that end up in the enclosing rule have to point to its
+//    guard. If the expanded rule is the longer of the two, the enclosing
+//    rule takes over its guard node instead, and only the enclosing rule's
+//    own symbols are changed, so the cost is that of the shorter rule.
 // ***************************************************************************
 void symbols::expand() {
   symbols *left = prev();
   symbols *right = next();
-  symbols *f = rule()->first();
-  symbols *l = rule()->last();
-
-  extern bool compression_initialized;
-  if (!compression_initialized) {
-    int i = 0;
-    symbols *s;
-    extern int max_rule_len;
-    // first calculate length of this rule (the one we are adding symbols to)
-    // symbol 'this' should not be counted because it will be deleted
-    s = next();
-    do {
-       if (!s->is_guard()) i++;
-       s = s->next();
-    } while(s != this);
-    // then calculate length of what is to be added
-    for (s = f; !s->is_guard(); s = s->next()) i++;
-    if (i > max_rule_len) max_rule_len = i;
-  }
+  rules *e = rule();            // the rule being expanded
+  rules *r = container();       // the rule it is expanded into
+  symbols *f = e->first();
+  symbols *l = e->last();
+  int length = r->length() - 1 + e->length();
+
+  Grammar *G = current;
+  if (length > G->max_rule_len) G->max_rule_len = length;
 
-  symbols **m = find_digram(this);
+  symbols **m = G->find_digram(this);
   if (!m) return;
-  delete rule();
 
-  for (int i = 0; i < K; i ++)
+  for (int i = 0; i < G->K; i ++)
     if (m[i] == this) {
       m[i] = (symbols *) 1;
-      occupied --;
+      G->occupied --;
     }
 
+  // the digram ending in this symbol has to go before 's' is cleared, as it
+  // can no longer be found in the hash table afterwards
+  left->delete_digram();
+
+  // take the rule's symbols out of its guard's ring (it does not belong to
+  // any digram, so there is nothing to update in the hash table)
+  symbols *eg = ptr(e->guard);
+  l->n = ref(f);
+  f->p = ref(l);
+
   s = 0; // if we don't do this, deleting the symbol tries to deuse the rule!
 
   delete this;
@@ -181,10 +539,39 @@ void symbols::expand() {
   join(left, f);
   join(l, right);
 
-  symbols **ll = find_digram(l);
+  symbols *rg = ptr(r->guard);
+  symbols *x;
+  if (e->length() <= r->length()) {
+    for (x = f; x != right; x = x->next()) x->g = r->guard;
+  }
+  else {
+    // put the expanded rule's guard in place of the enclosing rule's
+    eg->n = rg->n;
+    eg->p = rg->p;
+    eg->next()->p = eg->prev()->n = ref(eg);
+    for (x = eg->next(); x != f; x = x->next()) x->g = ref(eg);
+    for (x = eg->prev(); x != l; x = x->prev()) x->g = ref(eg);
+
+#ifdef COMPACT_NODES
+    eg->s = (G->rule_nodes.index(r) << 2) | 2;
+    rg->s = (G->rule_nodes.index(e) << 2) | 2;
+#else
+    eg->s = (ulong) r;
+    rg->s = (ulong) e;
+#endif
+    r->guard = ref(eg);
+    e->guard = ref(rg);
+    eg = rg;
+  }
+  r->Length = length;
+
+  eg->n = eg->p = ref(eg);
+  delete e;
+
+  symbols **ll = G->find_digram(l);
   if (ll) {
     *ll = l;
-    occupied ++;
+    G->occupied ++;
   }
 }
 
@@ -195,7 +582,7 @@ void symbols::expand() {
 // ***************************************************************************
 void symbols::substitute(rules *r)
 {
-  symbols *q = p;
+  symbols *q = prev();
 
   delete q->next();
   delete q->next();
@@ -205,160 +592,327 @@ void symbols::substitute(rules *r)
   if (!q->check()) q->next()->check();
 }
 
-int table_size;
-int lookups = 0;
-int collisions = 0;
-int occupied = 0;
-symbols **table = 0;
-
-// ***************************************************************************
-// symbols **find_digram(symbols *s)
+// The hash table is an array of buckets, each the size of a cache line
+// (or more, for large K). A bucket holds a few entries, and each entry has
+// K slots for occurrences of one digram. Every entry also has a 16-bit tag,
+// taken from the hash of its digram, and the tags of a bucket are kept
+// together at its start:
 //
-//     Search hash table for digram made of symbols s->value() and
-//     s->next()->value().
+//    | tag 0 | tag 1 | ... | slots of entry 0 | slots of entry 1 | ...
 //
-// Return value
-//   - if digram found : Pointer to hash table element where digram is stored.
-//   - otherwise       : 0
+// A lookup only follows the symbol stored in an entry, and the symbol after
+// it, to compare the digram when the tag matches, so it normally costs one
+// cache miss. Buckets are probed linearly, from the one the hash scales to
+// (so the number of buckets need not be a power of two).
 //
-// Global variables used
-//    delimiter  (symbol accross which not to form rules, see sequitur.cc)
-// ***************************************************************************
-symbols **find_digram(symbols *s)
+// A slot is 0 if the entry has never been used, and 1 if the occurrence it
+// held has been deleted (a tombstone). An entry is live while any of its
+// slots is neither.
+//
+// The table starts small and doubles when it gets more than 40% occupied,
+// the last time to as many buckets as fit in the memory given with -m. It
+// is also rebuilt when lookups start to take long, which happens when it
+// fills up with tombstones; once it may not grow, at the same size. Entries are
+// moved to the new table a few buckets at a time by rehash_step(), between
+// input symbols; until it is done, lookups search both tables.
+
+enum { CACHE_LINE = 64,
+       FIRST_BUCKETS = 1024,  // size of the table at the start
+       LONG_PROBE = 8,        // buckets probed that call for a rehash
+       STEP_BUCKETS = 16 };   // buckets moved at least by each rehash_step()
+
+// Allocate a table of the given number of buckets, all entries empty.
+void Grammar::create_table(digram_table &t, unsigned long buckets)
 {
-  if (!table) {
-    extern int memory_to_use;
-    table_size = memory_to_use / (K * sizeof(symbols *));
-    extern int quiet;
-
-    if (!quiet) {
-      cerr << "Using " << memory_to_use / 1000000
-	   << " MB of memory for the hash table." << endl;
-      cerr << "If this is too large for your machine, "
-	   << "or the hash table becomes more than" << endl;
-      cerr << "40% occupied, use -m to specify a new value." << endl << endl;
-    }
-    // find a prime less than the maximum table size
-    if (table_size % 2 == 0)
-      table_size --;
-    int max_factor = int(sqrt(float(table_size)));
-    while (1) {
-      int prime = 1;
-      for (int i = 3; i < max_factor; i += 2)
-	if (table_size % i == 0) {
-	  prime = 0;
-	  break;
-	}
-      if (prime)
-	break;
-      table_size -= 2;
-    }
+  if (bucket_bytes == 0) {
+    int entry_bytes = sizeof(unsigned short) + K * sizeof(symbols *);
+    bucket_entries = CACHE_LINE / entry_bytes;
+    if (bucket_entries == 0) bucket_entries = 1;
+
+    slots_offset = bucket_entries * sizeof(unsigned short);
+    slots_offset = (slots_offset + sizeof(symbols *) - 1) & ~(sizeof(symbols *) - 1);
+    bucket_bytes = slots_offset + bucket_entries * K * sizeof(symbols *);
+    bucket_bytes = (bucket_bytes + CACHE_LINE - 1) & ~(CACHE_LINE - 1);
+  }
 
-    table = (symbols **) malloc(table_size * K * sizeof(symbols *));
-    memset(table, 0, table_size * K * sizeof(symbols *));
+  t.buckets = (char *) get_memory(buckets * bucket_bytes);
+  if (t.buckets == 0) {
+    cerr << "sequitur: out of memory" << endl;
+    exit(1);
   }
+  t.size = buckets;
 
-  ulong one = s->raw_value();
-  ulong two = s->next()->raw_value();
+  table_size = buckets * bucket_entries;
+}
 
-  if (delimiter != -1 && (s->value() == delimiter || s->next()->value() == delimiter))
-    return 0;
+// Mix the two symbols of a digram into 64 bits (the finalizer of
+// MurmurHash3), the low 32 bits choosing the bucket and the high bits the tag.
+static inline unsigned long long hash_digram(ulong one, ulong two)
+{
+  unsigned long long h = one * 0x9e3779b97f4a7c15ULL ^ two;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
 
-  int jump = (17 - (one % 17)) * K;
-  int insert = -1;
+// The bucket of table t where the search for a digram with hash h starts.
+static inline unsigned long home_bucket(unsigned long long h,
+					unsigned long size)
+{
+  return (unsigned long) (((h & 0xffffffff) * size) >> 32);
+}
 
-  // Hash function: standard open addressing or double hashing. See Knuth.
+// Give up when there is no room left for a digram in a table that may not
+// grow any more.
+static void table_full()
+{
+  cerr << "sequitur: the hash table is full; "
+       << "use -m to give it more memory" << endl;
+  exit(1);
+}
 
-  ulong combined = ((one << 16) | (one >> 16)) ^ two;
-  int i = ((combined * (combined + 3)) % table_size) * K;
-  int original_i = i;
+// Search table t for the digram (one, two) with hash h. If it is not
+// there, return where it can be stored if 'insert' is set, otherwise 0.
+// 'probes' is increased by the number of buckets looked at.
+//
+// A table that may not grow can have no unused entry left, only live ones
+// and tombstones; the search then stops when it has been all the way
+// round, and the first tombstone is where the digram goes.
+symbols **Grammar::probe(digram_table &t, ulong one, ulong two,
+			  unsigned long long h, bool insert, int &probes)
+{
+  unsigned short tag = (unsigned short) (h >> 48);
+  unsigned long b = home_bucket(h, t.size);
+  unsigned long left = t.size - 1;
 
-  lookups ++;
+  symbols **free_slots = 0;
+  unsigned short *free_tag = 0;
 
   while (1) {
-    symbols *m = table[i];
-    if (!m) {
-      if (insert == -1) insert = i;
-      return &table[insert];
+    char *bucket = t.buckets + b * bucket_bytes;
+    unsigned short *tags = (unsigned short *) bucket;
+    symbols **slots = (symbols **) (bucket + slots_offset);
+
+    probes ++;
+
+    for (int e = 0; e < bucket_entries; e ++, slots += K) {
+      symbols *m = slots[0];
+      if (!m) {
+	if (!insert) return 0;
+	if (!free_slots) {
+	  free_slots = slots;
+	  free_tag = &tags[e];
+	}
+	// the tag of an entry only matters once a slot is written, so it
+	// can be set here, whether the caller stores the digram or not
+	*free_tag = tag;
+	return free_slots;
+      }
+      for (int i = 1; ulong(m) == 1 && i < K; i ++) m = slots[i];
+      if (ulong(m) <= 1) {
+	if (!free_slots) {
+	  free_slots = slots;
+	  free_tag = &tags[e];
+	}
+      }
+      else if (tags[e] == tag) {
+	if (m->raw_value() == one && m->next()->raw_value() == two)
+	  return slots;
+	tag_misses ++;
+      }
     }
-    else if (ulong(m) == 1) insert = i;
-    else if (m->raw_value() == one && m->next()->raw_value() == two)
-      return &table[i];
-    i = (i + jump) % table_size;
+
+    if (left -- == 0) {
+      if (!insert) return 0;
+      if (!free_slots) table_full();
+      *free_tag = tag;
+      return free_slots;
+    }
+    if (++ b == t.size) b = 0;
 
     // this is only a collision if we're not inserting
-    if (insert == -1) 
+    if (!free_slots)
       collisions ++;
   }
 }
 
-// **************************************************************************
-// rules::reproduce()
-//    Reproduce full expansion of a rule.
-// **************************************************************************
-void rules::reproduce()
+// ***************************************************************************
+// symbols **Grammar::find_digram(symbols *s)
+//
+//     Search hash table for digram made of symbols s->value() and
+//     s->next()->value().
+//
+// Return value
+//   - if digram found : Pointer to the K slots of the entry where the
+//                       digram is stored.
+//   - otherwise       : Pointer to the K slots of an entry where it can be
+//                       stored, or 0 if it contains a delimiter.
+//
+// Grammar variables used
+//    delimiter  (symbol accross which not to form rules)
+// ***************************************************************************
+symbols **Grammar::find_digram(symbols *s)
 {
-  // for each symbol of the rule, call symbols::reproduce()!
-  for (symbols *p = first(); !p->is_guard(); p = p->next())
-    p->reproduce();
-}
+  if (!table.buckets) create_table(table, FIRST_BUCKETS);
+
+  ulong one = s->raw_value();
+  ulong two = s->next()->raw_value();
+
+  if (delimiter != -1 &&
+      ((!s->non_terminal() && s->value() == delimiter) ||
+       (!s->next()->non_terminal() && s->next()->value() == delimiter)))
+    return 0;
 
+  unsigned long long h = hash_digram(one, two);
+  symbols **x = 0;
+  int probes = 0;
 
-// **************************************************************************
-// Overload operator << to write symbols of the grammar to streams,
-//    in a formatted manner.
-// **************************************************************************
-ostream &operator << (ostream &o, symbols &s)
+  lookups ++;
+
+  // during a rehash, digrams whose bucket has not been moved yet are still
+  // in the old table (and new ones never are)
+  if (old_table.buckets) {
+    unsigned long b = home_bucket(h, old_table.size);
+    if ((b >= moved_from ? b : b + old_table.size) - moved_from >= moved)
+      x = probe(old_table, one, two, h, false, probes);
+  }
+  if (!x)
+    x = probe(table, one, two, h, true, probes);
+
+  probe_lengths[probes < PROBE_LENGTHS ? probes : PROBE_LENGTHS - 1] ++;
+  // once the table may not grow, a rebuild only clears out tombstones, and
+  // costs as much as ever, so it waits for longer lookups
+  if (probes > (warned ? 4 * LONG_PROBE : LONG_PROBE)) rehash_wanted = true;
+  recent_lookups ++;
+  recent_probes += probes;
+
+  return x;
+}
+
+// Is there an entry in bucket b of table t that was never used? If so, no
+// lookup continues past the bucket into the next one.
+bool Grammar::has_unused_entry(digram_table &t, unsigned long b)
 {
-  extern int numbers;
-
-  if (s.non_terminal())
-     o << s.rule()->index();
-  else if (numbers & do_uncompress) o << s.value() << endl;
-  else if (numbers) o << '[' << s.value() << ']';
-  else if (do_uncompress) o << char(s.value());
-  else if (s.value() == '\n') o << "\\n";
-  else if (s.value() == '\t') o << "\\t";
-  else if (s.value() == ' ' ) o << '_';
-  else if (s.value() == '\\' ||
-       s.value() == '(' ||
-       s.value() == ')' ||
-       s.value() == '_' ||
-       isdigit(s.value()))
-    o << '\\' << char(s.value());
-  else o << char(s.value());
-
-  return o;
+  symbols **slots = (symbols **) (t.buckets + b * bucket_bytes + slots_offset);
+  for (int e = 0; e < bucket_entries; e ++, slots += K)
+    if (!slots[0]) return true;
+  return false;
 }
 
-// **************************************************************************
-// rules::output()
+// Move the entries of bucket b of the old table to the new one. Returns
+// true if the bucket had an entry that was never used.
+bool Grammar::move_bucket(unsigned long b)
+{
+  char *bucket = old_table.buckets + b * bucket_bytes;
+  symbols **slots = (symbols **) (bucket + slots_offset);
+  bool ends_chains = false;
 
-//    Print right hand of this rule. If right hand contains non-terminals,
-//    descend recursively and print right hands of subordinated rules, if
-//    these have not been printed out yet.
+  for (int e = 0; e < bucket_entries; e ++, slots += K) {
+    symbols *m = slots[0];
+    if (!m) {
+      ends_chains = true;
+      continue;
+    }
+    for (int i = 1; ulong(m) == 1 && i < K; i ++) m = slots[i];
+    if (ulong(m) <= 1) continue;
+
+    int probes = 0;
+    symbols **x = probe(table, m->raw_value(), m->next()->raw_value(),
+			hash_digram(m->raw_value(), m->next()->raw_value()),
+			true, probes);
+    memcpy(x, slots, K * sizeof(symbols *));
+  }
+  return ends_chains;
+}
+
+// ***************************************************************************
+// void Grammar::rehash_step()
 //
-//    Also, numbers the rule, which will indicate that right hand has been
-//    printed out.
+//     Called between input symbols, when no pointers into the hash table
+//     are held. Starts rebuilding the table if it is too full, or too slow
+//     to search, and moves the next few buckets of the old table to the new.
 //
-// Global variables used
-//    current_rule, print_rule_usage
-// **************************************************************************
-void rules::output()
+// Grammar variables used
+//    memory_to_use  (upper limit on the size of the table)
+// ***************************************************************************
+void Grammar::rehash_step()
 {
-  symbols *s;
+  if (!old_table.buckets) {
+    if (!table.buckets) return;
+
+    unsigned long buckets = table.size;
+    unsigned long most = memory_to_use / bucket_bytes;
+    bool full = occupied > table_size * 0.4;
+    bool can_grow = buckets < most;
+
+    if (full && !can_grow) {
+      // past this, most lookups would search much of the table
+      if (occupied > table_size * 0.95) table_full();
+      if (!warned && !quiet)
+	cerr << "The hash table is more than 40% occupied, "
+	     << "and cannot grow beyond the limit set with -m." << endl;
+      warned = true;
+      // it can still be rebuilt at the same size, which clears out the
+      // tombstones; without that they would take every unused entry
+      full = false;
+    }
+    // tombstones lengthen lookups a little at a time, so look at the average
+    // once in a while as well
+    if (recent_lookups > table_size) {
+      if (recent_probes > 1.5 * recent_lookups) rehash_wanted = true;
+      recent_lookups = recent_probes = 0;
+    }
 
-  for (s = first(); !s->is_guard(); s = s->next())
-     if (s->non_terminal() && s->rule()->index() == 0)
-        s->rule()->output();
+    if (!full && !rehash_wanted) return;
+    if (full) buckets = 2 * buckets < most ? 2 * buckets : most;
+    rehash_wanted = false;
 
-  number = current_rule ++;
+    // start moving at a bucket that no lookup enters from the one before
+    unsigned long b = 0;
+    while (b < table.size && !has_unused_entry(table, b)) b ++;
 
-  for (s = first(); !s->is_guard(); s = s->next())
-    cout << *s << ' ';
+    old_table = table;
+    create_table(table, buckets);
+    moved_from = b + 1 < old_table.size ? b + 1 : 0;
+    moved = 0;
+    rehashes ++;
 
-  extern int print_rule_usage;
-  if (print_rule_usage) cout << "\t(" << Usage << ")";
+    // without such a bucket, lookups could wrap around the whole table
+    if (b == old_table.size) {
+      moved_from = 0;
+      while (moved < old_table.size) move_bucket(moved ++);
+    }
+  }
 
-  cout << endl;
+  int n = 0;
+  while (moved < old_table.size) {
+    unsigned long b = moved_from + moved;
+    bool ends_chains = move_bucket(b < old_table.size ? b : b - old_table.size);
+    moved ++;
+    if (++ n >= STEP_BUCKETS && ends_chains) break;
+  }
+
+  if (moved == old_table.size) {
+    free_memory(old_table.buckets, old_table.size * bucket_bytes);
+    old_table.buckets = 0;
+  }
+}
+
+// Print statistics on the use of the hash table (option -s).
+void Grammar::print_table_stats()
+{
+  cerr << "hash table: " << table_size << " entries in buckets of "
+       << bucket_entries << ", " << occupied << " occupied ("
+       << 100.0 * occupied / table_size << "%), rebuilt "
+       << rehashes << " times" << endl;
+  cerr << lookups << " lookups, " << tag_misses
+       << " tag matches for other digrams" << endl;
+  cerr << "buckets probed:";
+  for (int i = 1; i < PROBE_LENGTHS; i ++)
+    cerr << ' ' << i << (i == PROBE_LENGTHS - 1 ? "+" : "") << ": "
+	 << probe_lengths[i];
+  cerr << endl;
 }
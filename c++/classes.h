@@ -10,19 +10,246 @@
 #include <iostream>
 #include <memory.h> // for memset
 #include <stdlib.h> // for malloc
+#include <stdint.h>
 
 using namespace std;
 
-extern int num_symbols, current_rule, K;
-extern int occupied, table_size;
+enum { PROBE_LENGTHS = 9 };    // histogram buckets for print_table_stats()
 
 class symbols;
 class rules;
+class benchmark;
 ostream &operator << (ostream &o, symbols &s);
 
 typedef unsigned long ulong;
 
-extern symbols **find_digram(symbols *s);     // defined in classes.cc
+// With COMPACT_NODES defined, symbols refer to each other, and to their
+// rules, by 32-bit indices into two contiguous arrays (see node_pool below)
+// instead of by pointers. A symbol then takes 16 bytes instead of 32, and a
+// rule 20 instead of 24, on 64-bit machines (checked at the end of this
+// file). Terminals are limited to 31 bits, and a grammar to 2^30 rules and
+// 2^32 symbols.
+
+#ifdef COMPACT_NODES
+typedef uint32_t node_ref;
+#else
+typedef symbols *node_ref;
+#endif
+
+///////////////////////////////////////////////////////////////////////////
+
+// node_arena - allocator for the nodes of a grammar.
+//
+// Symbols and rules are small, and check() creates and destroys them at a
+// very high rate, so rather than getting each one from malloc() they are
+// carved out of large blocks. Objects are grouped in size classes (multiples
+// of GRANULE bytes); a freed object goes onto the free list of its class and
+// is handed out again by the next allocation of that size. Nothing is
+// returned to the system until release_all(), which frees every block at
+// once - after that, no node allocated before the call may be used.
+
+class node_arena {
+  enum { GRANULE = 8,                  // size classes are multiples of this
+         CLASSES = 8,                  // largest object is CLASSES * GRANULE
+         BLOCK_SIZE = 1 << 22 };       // bytes requested from the system at once
+
+  void *free_list[CLASSES];            // recycled objects, per size class
+  char *block_next, *block_end;        // unused part of the current block
+  void *blocks;                        // all blocks, chained for release_all()
+
+  void *refill(int c);                 // allocate from a new block
+
+public:
+  node_arena() {
+    memset(free_list, 0, sizeof(free_list));
+    block_next = block_end = 0;
+    blocks = 0;
+  }
+
+  void *alloc(size_t size) {
+    int c = (size - 1) / GRANULE;
+    assert(c < CLASSES);
+    void *p = free_list[c];
+    if (p) {
+      free_list[c] = *(void **) p;
+      return p;
+    }
+    size_t bytes = (c + 1) * GRANULE;
+    if (block_end - block_next < (long) bytes) return refill(c);
+    p = block_next;
+    block_next += bytes;
+    return p;
+  }
+
+  void release(void *p, size_t size) {
+    int c = (size - 1) / GRANULE;
+    *(void **) p = free_list[c];
+    free_list[c] = p;
+  }
+
+  void release_all();
+};
+
+#ifdef COMPACT_NODES
+
+// node_pool - array of nodes of type T, addressed by 32-bit index.
+//
+// The whole array (capacity elements) is reserved as address space when the
+// first node is allocated, and memory is only committed as it is touched, so
+// nodes never move and the index of a node is fixed for its lifetime. Index
+// 0 is never handed out and plays the part of the null pointer. Freed nodes
+// are linked through their first word and reused first.
+
+template <class T> class node_pool {
+  T *base;                             // start of the array
+  uint32_t top;                        // first index never handed out
+  uint32_t limit;                      // capacity, or 0 before reservation
+  uint32_t free_list;                  // recycled nodes
+  static const uint32_t capacity;      // largest index, plus one
+
+  void grow();                         // reserve the array, or give up
+
+public:
+  node_pool() { base = 0; top = limit = free_list = 0; }
+
+  T *at(uint32_t i)     { return base + i; }
+  uint32_t index(T *p)  { return p - base; }
+
+  void *alloc() {
+    uint32_t i = free_list;
+    if (i) {
+      free_list = *(uint32_t *) at(i);
+      return at(i);
+    }
+    if (top == limit) grow();
+    return at(top ++);
+  }
+
+  void release(void *p) {
+    *(uint32_t *) p = free_list;
+    free_list = index((T *) p);
+  }
+
+  void release_all();
+};
+
+#endif
+
+///////////////////////////////////////////////////////////////////////////
+
+namespace sequitur {
+
+class Grammar;
+
+// The grammar that symbols and rules are created in, changed and deleted
+// from. Each thread has its own; it is set by the methods of Grammar that
+// change the grammar, and by Grammar::select() for code that works on the
+// symbols and rules directly.
+extern thread_local Grammar *current;
+
+// Grammar - a grammar being inferred from a sequence of symbols, with all
+// the state needed to do that: the nodes of the grammar, the hash table of
+// digrams and the options they are formed with. Any number of grammars can
+// be built at once, each of them by one thread at a time.
+
+class Grammar {
+  rules *S;                 // main rule of the grammar
+
+  int num_rules;            // number of rules in the grammar
+  int num_symbols;          // number of symbols in the grammar
+  int min_terminal,         // minimum and maximum value among terminal symbols
+      max_terminal;         //
+  int max_rule_len;         // maximum rule length
+  unsigned long length;     // number of symbols appended
+
+  // minimum number of times a digram must occur to form rule minus one
+  // (e.g. if K is 1, two occurrences are required to form rule)
+  int K;
+
+  // rules are not formed across (i.e. including) this terminal, if not -1
+  int delimiter;
+
+  long memory_to_use;       // upper limit on the size of the hash table, in bytes
+  bool quiet;               // do not warn when the table cannot grow
+
+#ifdef COMPACT_NODES
+  node_pool<symbols> symbol_nodes;
+  node_pool<rules> rule_nodes;
+#else
+  node_arena nodes;
+#endif
+
+  // the hash table of digrams (see classes.cc)
+  struct digram_table {
+    char *buckets;          // start of the first bucket
+    unsigned long size;     // number of buckets
+  };
+
+  digram_table table, old_table;
+  unsigned long moved_from, moved; // buckets of old_table moved so far
+  bool rehash_wanted;
+  bool warned;              // the table is full and may not grow
+  long recent_lookups, recent_probes; // since the table was last checked
+  int bucket_entries, bucket_bytes, slots_offset;
+
+  int table_size;           // number of entries
+  int occupied;
+  int lookups;
+  int collisions;           // buckets probed before a free entry was seen
+  int probe_lengths[PROBE_LENGTHS]; // lookups by number of buckets probed
+  int tag_misses;           // matching tags that belonged to another digram
+  int rehashes;
+
+  void create_table(digram_table &t, unsigned long buckets);
+  symbols **probe(digram_table &t, ulong one, ulong two,
+		  unsigned long long h, bool insert, int &probes);
+  bool has_unused_entry(digram_table &t, unsigned long b);
+  bool move_bucket(unsigned long b);
+  symbols **find_digram(symbols *s);
+
+  void push(symbols *s);    // add to the end of rule S, and check
+  void expand_rules_used_once();
+
+  Grammar(const Grammar &);             // not copyable
+  void operator = (const Grammar &);
+
+  friend class ::symbols;
+  friend class ::rules;
+  friend class ::benchmark; // times find_digram() (bench.cc)
+
+public:
+  // k is the minimum number of times a digram must occur to form a rule
+  Grammar(int k = 2, int delimiter = -1, long memory_to_use = 1000000000,
+	  bool quiet = false);
+  ~Grammar();               // frees the whole grammar
+
+  // make this the grammar of the calling thread
+  void select() { current = this; }
+
+  // add n symbols to the end of rule S, enforcing the constraints after each
+  void append(const uint32_t *syms, size_t n);
+
+  // add the sequences of n grammars, built from consecutive pieces of the
+  // input, to the end of rule S, together with their rules
+  void merge(Grammar *parts[], int n);
+
+  // let the hash table grow, if it needs to, while no lookup is in use;
+  // append() does this, other code that inserts symbols has to call it
+  void rehash_step();
+
+  void print_table_stats();  // statistics on the hash table, to stderr
+
+  rules *start()             { return S; }
+  int rule_count()           { return num_rules; }
+  int symbol_count()         { return num_symbols; }
+  int min_terminal_value()   { return min_terminal; }
+  int max_terminal_value()   { return max_terminal; }
+  int longest_rule()         { return max_rule_len; }
+  double collisions_per_lookup() { return collisions / double(lookups); }
+  double occupancy()         { return double(occupied) / table_size; }
+};
+
+}
 
 ///////////////////////////////////////////////////////////////////////////
 
@@ -32,7 +259,11 @@ class rules {
   // It points forward to the first symbol in the rule, and backwards
   // to the last symbol in the rule. Its own value points to the rule data
   // structure, so that symbols can find out which rule they're in
-  symbols *guard;
+  node_ref guard;
+
+  // Length is the number of symbols in the rule's right hand, kept up to
+  // date as symbols are inserted and deleted
+  int Length;
 
   // count keeps track of the number of times the rule is used in the grammar
   int count;
@@ -51,6 +282,8 @@ class rules {
   //     (used in compression and forget_print())
   int number;
 
+  friend class symbols;  // symbols::expand() hands guards between rules
+
 public:
   void output();     // output right hand of the rule when printing out grammar
   void output2();    // output right hand of the rule when compressing
@@ -58,6 +291,20 @@ public:
   rules();
   ~rules();
 
+#ifdef COMPACT_NODES
+  void *operator new(size_t) {
+    return sequitur::current->rule_nodes.alloc();
+  }
+  void operator delete(void *p) { sequitur::current->rule_nodes.release(p); }
+#else
+  void *operator new(size_t size) {
+    return sequitur::current->nodes.alloc(size);
+  }
+  void operator delete(void *p, size_t size) {
+    sequitur::current->nodes.release(p, size);
+  }
+#endif
+
   void reuse() { count ++; }
   void deuse() { count --; }
 
@@ -65,6 +312,8 @@ public:
   symbols *last();      // pointer to last symbol of rule's right hand
 
   int freq()           { return count; }
+  int length()         { return Length; }
+  void length(int i)   { Length += i; }
   int usage()          { return Usage; }
   void usage(int i)    { Usage += i; }
   int index()          { return number; }
@@ -74,42 +323,75 @@ public:
 };
 
 class symbols {
-  symbols *n, *p;     // next and previous symbol within the rule
-  ulong s;            // symbol value (e.g. ASCII code, or rule index)
+  node_ref n, p;      // next and previous symbol within the rule
+  node_ref g;         // guard node of the rule; a guard points to itself
+
+  // symbol value: for a terminal, its code times two plus one. Otherwise
+  // the rule, as a pointer or, with COMPACT_NODES, as its index times four,
+  // plus two if this is the rule's guard node.
+#ifdef COMPACT_NODES
+  uint32_t s;
+#else
+  ulong s;
+#endif
 
 public:
 
-  // print out symbol, or, if it is non-terminal, rule's full expansion
-  void reproduce() {
-    extern int numbers;
+#ifdef COMPACT_NODES
+  void *operator new(size_t) {
+    return sequitur::current->symbol_nodes.alloc();
+  }
+  void operator delete(void *p) { sequitur::current->symbol_nodes.release(p); }
 
-    if (non_terminal()) rule()->reproduce();
-    else {
-      cout << *this;
-      if (numbers) cout << ' ';
-    }
+  // convert between references to symbols and pointers (an unlinked
+  // reference, 0, must not be followed; join() tests n and p directly)
+  static symbols *ptr(node_ref r) {
+    return sequitur::current->symbol_nodes.at(r);
+  }
+  static node_ref ref(symbols *x) {
+    return sequitur::current->symbol_nodes.index(x);
+  }
+#else
+  void *operator new(size_t size) {
+    return sequitur::current->nodes.alloc(size);
+  }
+  void operator delete(void *p, size_t size) {
+    sequitur::current->nodes.release(p, size);
   }
 
+  static symbols *ptr(node_ref r)   { return r; }
+  static node_ref ref(symbols *x)   { return x; }
+#endif
+
+  // print out symbol, or, if it is non-terminal, rule's full expansion
+  void reproduce();
+
   // initializes a new terminal symbol
   symbols(ulong sym) {
     s = sym * 2 + 1; // an odd number, so that they're a distinct
                      // space from the rule pointers, which are 4-byte aligned
-    p = n = 0;
-    num_symbols ++;
+    p = n = g = 0;
+    sequitur::current->num_symbols ++;
   }
 
   // initializes a new symbol to refer to a rule, and increments the reference
   // count of the corresponding rule
   symbols(rules *r) {
+#ifdef COMPACT_NODES
+    s = sequitur::current->rule_nodes.index(r) << 2;
+#else
     s = (ulong) r;
-    p = n = 0;
+#endif
+    p = n = g = 0;
     rule()->reuse();
-    num_symbols ++;
+    sequitur::current->num_symbols ++;
   }
 
   // links two symbols together, removing any old digram from the hash table
+  // (left == right only for the guard of a rule whose symbols have all
+  // been deleted; it is not part of any digram and must not be recorded)
   static void join(symbols *left, symbols *right) {
-    if (left->n) {
+    if (left->n && left != right) {
       left->delete_digram();
 
       // This is to deal with triples, where we only record the second
@@ -117,62 +399,74 @@ public:
       // we insert the first pair into the hash table so that we don't
       // forget about it.  e.g. abbbabcbb
 
+      sequitur::Grammar *G = sequitur::current;
+
       if (right->p && right->n &&
-          right->value() == right->p->value() &&
-          right->value() == right->n->value()) {
-        assert(find_digram(right));
-        symbols **r = find_digram(right);
+          right->raw_value() == right->prev()->raw_value() &&
+          right->raw_value() == right->next()->raw_value()) {
+        symbols **r = G->find_digram(right);
         if (r) { // necessary when using delimiters
           *r = right;
-          occupied ++;
+          G->occupied ++;
         }
       }
 
       if (left->p && left->n &&
-          left->value() == left->n->value() &&
-          left->value() == left->p->value()) {
-        symbols **lp = find_digram(left->p);
+          left->raw_value() == left->next()->raw_value() &&
+          left->raw_value() == left->prev()->raw_value()) {
+        symbols **lp = G->find_digram(left->prev());
         if (lp) { // necessary when using delimiters
-          *lp = left->p;
-          occupied ++;
+          *lp = left->prev();
+          G->occupied ++;
         }
       }
     }
-    left->n = right; right->p = left;
+    left->n = ref(right); right->p = ref(left);
   }
 
   // cleans up for symbol deletion: removes hash table entry and decrements
-  // rule reference count
+  // rule reference count and length
   ~symbols() {
-    join(p, n);
+    join(prev(), next());
     if (!is_guard()) {
       delete_digram();
       if (non_terminal()) rule()->deuse();
+      container()->length(-1);
     }
-    num_symbols --;
+    sequitur::current->num_symbols --;
   }
 
   // inserts a symbol after this one.
   void insert_after(symbols *y) {
-    join(y, n);
+    join(y, next());
     join(this, y);
+    y->g = g;
+    container()->length(1);
   }
 
+  // the rule whose right hand this symbol is in
+  rules *container() { return ptr(g)->rule(); }
+
   // removes the digram from the hash table
   void delete_digram() {
-    if (is_guard() || n->is_guard()) return;
-    symbols **m = find_digram(this);
+    if (is_guard() || next()->is_guard()) return;
+    sequitur::Grammar *G = sequitur::current;
+    symbols **m = G->find_digram(this);
     if (m == 0) return;
-    for (int i = 0; i < K; i ++)
+    for (int i = 0; i < G->K; i ++)
       if (m[i] == this) {
 	m[i] = (symbols *) 1;
-	occupied --;
+	G->occupied --;
       }
   }
 
   // is_guard() returns true if this is the guard node
   // marking the beginning/end of a rule
-  bool is_guard() { return non_terminal() && rule()->first()->prev() == this; }
+#ifdef COMPACT_NODES
+  bool is_guard() { return (s & 3) == 2; }
+#else
+  bool is_guard() { return g == this; }
+#endif
 
   // non_terminal() returns true if a symbol is non-terminal.
   // We make sure that terminals have odd-numbered values.
@@ -182,13 +476,17 @@ public:
 
   int non_terminal() { return ((s % 2) == 0) && (s != 0);}
 
-  symbols *next() { return n; }
-  symbols *prev() { return p; }
+  symbols *next() { return ptr(n); }
+  symbols *prev() { return ptr(p); }
   inline ulong raw_value() { return s; }
   inline ulong value() { return s / 2; }
 
   // assuming this is a non-terminal, rule() returns the corresponding rule
+#ifdef COMPACT_NODES
+  rules *rule() { return sequitur::current->rule_nodes.at(s >> 2); }
+#else
   rules *rule() { return (rules *) s; }
+#endif
 
   // substitute digram with non-terminal symbol
   void substitute(rules *r);
@@ -199,6 +497,23 @@ public:
   // substitute non-terminal symbol with its rule's right hand
   void expand();
 
-  void point_to_self() { join(this, this); }
+  // makes this symbol the guard node of its (empty) rule
+  void point_to_self() {
+    join(this, this);
+    g = ref(this);
+#ifdef COMPACT_NODES
+    s |= 2;
+#endif
+  }
 
 };
+
+// the sizes the comment on COMPACT_NODES gives, with 64-bit pointers
+#ifdef COMPACT_NODES
+static_assert(sizeof(symbols) == 16 && sizeof(rules) == 20,
+	      "compact symbols and rules are not 16 and 20 bytes");
+#else
+static_assert(sizeof(void *) != 8 ||
+	      (sizeof(symbols) == 32 && sizeof(rules) == 24),
+	      "symbols and rules are not 32 and 24 bytes");
+#endif
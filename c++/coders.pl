@@ -0,0 +1,59 @@
+#!/usr/bin/perl -w
+
+# Compression of the test files with each coder of --coder, and the speed
+# of compressing and decompressing them. Each time is the best of a few
+# runs over all the files; files named on the command line are used
+# instead of the test files.
+
+use Time::HiRes qw(time);
+
+$sequitur = "./sequitur";
+@coders = ("arith", "range", "rans");
+@files = @ARGV ? @ARGV :
+    map { "testfiles/$_" } ("code.input", "exe.input", "random.input");
+$runs = 5;
+
+# best time of $runs runs of a command
+sub best_time {
+    my($command) = @_;
+    my $best;
+
+    for (1 .. $runs) {
+	my $start = time;
+	system($command) == 0 or die "$command failed\n";
+	my $elapsed = time - $start;
+	$best = $elapsed if !defined $best || $elapsed < $best;
+    }
+    return $best;
+}
+
+print "coder   ";
+foreach $file (@files) { printf "%14s", substr($file, rindex($file, "/") + 1); }
+printf "%14s%12s%12s\n", "all", "-c MB/s", "-u MB/s";
+
+foreach $coder (@coders) {
+    printf "%-8s", $coder;
+
+    $total_in = $total_out = $compress_time = $uncompress_time = 0;
+    foreach $file (@files) {
+	$compressed = "/tmp/$$." . substr($file, rindex($file, "/") + 1);
+	$compress = "$sequitur -cq --coder=$coder < $file > $compressed";
+	$uncompress = "$sequitur -uq < $compressed > /tmp/$$.uncompressed";
+
+	$compress_time += best_time($compress);
+	$uncompress_time += best_time($uncompress);
+	system("cmp -s /tmp/$$.uncompressed $file") == 0
+	    or die "$file does not decompress with --coder=$coder\n";
+
+	$in = -s $file;
+	$out = -s $compressed;
+	$total_in += $in;
+	$total_out += $out;
+	printf "%10.3f bpc", $out / $in * 8;
+	unlink $compressed;
+    }
+    printf "%10.3f bpc%12.2f%12.2f\n", $total_out / $total_in * 8,
+	$total_in / $compress_time / 1e6, $total_in / $uncompress_time / 1e6;
+}
+
+unlink "/tmp/$$.uncompressed";
@@ -22,11 +22,20 @@
  ****************************************************************************/
 
 
-#include <assert.h>
 #include <stdio.h>
 #include <math.h>
+#include <setjmp.h>
+#include <string.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include "classes.h"
+#include "compress.h"
+#include "tokens.h"
 
 extern "C" {
 #include "arith.h"
@@ -34,21 +43,80 @@ extern "C" {
 #include "bitio.h"
 }
 
-static context *symbol,            // special symbols, terminals, non-terminals
+// The state of compression and decompression is kept per thread, so that
+// threads can each compress or decompress a block of their own (see
+// blocks.cc).
+
+// the stream being written or read (to stdout or from stdin, unless
+// uncompress() or the functions in memory below say otherwise)
+static thread_local coder_state stream;
+
+// whether the stream is being written, rather than read
+static thread_local bool encoding;
+
+static thread_local context
+               *symbol,            // special symbols, terminals, non-terminals
                *lengths,           // rule lengths
   // codes that indicate whether a rule should be kept in memory or deleted
-               *keep;
+               *keep,
+               *spelling;          // characters of tokens, with --tokens
+
+// The options of compression, which sequitur.cc sets from the command
+// line. They are defined here, so that compress() and decompress() (see
+// compress.h) can be linked without sequitur.cc; those take options of
+// their own.
+int quiet = 0,
+  numbers = 0,    // -d: symbols are written as numbers, one per line
+  delimiter = -1,
+
+  // minimum number of times a digram must occur to form rule
+  k = 2,
+
+  // number of pieces the input is split into, each read by a thread (-j);
+  // with -b, the number of threads compressing or decompressing blocks
+  threads = 1,
+
+  // whether the compressed output is written in frames (--frame-size or
+  // --frame-ms)
+  streaming = 0,
+
+  // the coder of the compressed output (--coder)
+  coder = ARITHMETIC_CODER,
+
+  // with 1, terminals are coded in the context of the terminal before them
+  // (--order)
+  order = 0;
+
+// upper limit on the size of the hash table, in bytes
+long memory_to_use = 1000000000;
+
+// the options given to compress() (see compress.h), while it runs on this
+// thread; the coder and order above are used otherwise
+static thread_local const sequitur::options *given;
 
-extern int compress;
+// minimum and maximum terminal codes and maximum rule length of the grammar
+// being compressed, or read from the compressed file
+static thread_local int min_terminal, max_terminal, max_rule_len;
+
+// whether the file is written in frames (see end_frame())
+static thread_local int streamed;
 
 // special symbols in the "symbol" context
 #define START_RULE       0
 #define END_OF_FILE      1
 #define STOP_FORGETTING  2
-#define SPECIAL_SYMBOLS  3         // how many special symbols there are
-#define FIRST_TERMINAL   3         // starting code for terminal symbols
+#define END_OF_FRAME     3         // only in streamed files
+#define SPECIAL_SYMBOLS  4         // how many special symbols there are
+#define FIRST_TERMINAL   5         // starting code for terminal symbols
 #define FIRST_RULE       4         // starting code for non-terminal symbols
 
+// Files of version 0 of the format (see read_coder() in arith.c) were
+// written before frames, with no END_OF_FRAME, so their terminal codes
+// start at 3. They are decoded in contexts laid out as they were written,
+// and their terminal codes are moved up to those above as they are read.
+#define OLD_SPECIAL_SYMBOLS  3
+#define OLD_FIRST_TERMINAL   3
+
 #define MINMAXTERM_TARGET  100000000
 #define MAXRULELEN_TARGET  10000
 
@@ -73,24 +141,200 @@ extern int compress;
 #define IS_TERMINAL(code)        ((code) & 1)
 #define IS_NONTERMINAL(code)   (!((code) & 1))
 
-// size of array containing pointers to rules, used at decompression
-#define UNCOMPRESS_RSIZE  1000000
+// With --tokens, a terminal is followed the first time it is sent by its
+// characters, and this code in the "spelling" context. The characters of
+// all tokens make up the vocabulary of the compressed file. The file says
+// so with a flag of its model, so that sequitur -u needs no --tokens (or
+// -w) to read it; the decoder goes by the flag rather than by 'tokens'.
+#define END_OF_TOKEN      256
+#define MODEL_TOKENS      2        // flag of the model
+
+// whether each token has been spelled yet
+static thread_local vector<bool> spelled;
+
+// whether a code is that of a terminal, rather than a special symbol
+#define IS_TERMINAL_CODE(code)   ((code) >= SPECIAL_SYMBOLS && IS_TERMINAL(code))
+
+// With --order=1, a symbol that follows a terminal, in a rule or in rule S,
+// is coded first in a context of the symbols that have followed that
+// terminal before, its followers: as the entry of the terminal there, as
+// OTHER_FOLLOWER if it is a non-terminal or special symbol, or as an escape
+// if it is a terminal not yet seen there. The last two are then coded in
+// the "symbol" context as before.
+//
+// In a grammar that is never forgotten, a digram appears only once, so a
+// terminal seldom follows another twice; the followers pay off when rules
+// are forgotten (-f) or rules are not formed across frames. So the
+// followers of a terminal are only coded in while more than one symbol in
+// FOLLOWER_HIT_RATE after it (of the last FOLLOWER_WINDOW or so) was a
+// follower already; until then they are kept up to date, but not coded in.
+//
+// Contexts of followers are made as they are needed, with no more than
+// FOLLOWER_LIMIT entries in all; after that, symbols are coded in the
+// "symbol" context alone. The file says which model it was coded with
+// (see write_coder() in arith.c).
+#define MODEL_ORDER1      1        // flag of the model
+#define MODEL_KNOWN       (MODEL_ORDER1 | MODEL_TOKENS)  // all flags read
+#define OTHER_FOLLOWER    0
+#define FOLLOWER_LIMIT    (1 << 20)
+#define FOLLOWER_HIT_RATE 4
+#define FOLLOWER_WINDOW   256
+
+struct followers {
+  context *c;
+  vector<int> code;                // of each entry of c
+  unordered_map<int, int> entry;   // of each code
+  int uses, hits;                  // symbols after the terminal, and how
+                                   // many of them were followers already
+};
+
+#define FOLLOWERS_USEFUL(f)   ((f)->hits > (f)->uses / FOLLOWER_HIT_RATE)
+
+// Count a symbol after followers f, and whether it was one of them.
+static inline void count_follower(followers *f, bool hit)
+{
+  f->uses ++;
+  f->hits += hit;
+  if (f->uses == FOLLOWER_WINDOW) {
+    f->uses >>= 1;
+    f->hits >>= 1;
+  }
+}
+
+static thread_local int model;     // flags of the model of the file
+static thread_local unordered_map<int, followers> follower_contexts;
+static thread_local int follower_entries;
+
+// code of the symbol before the one being coded, in its rule; -1 at the
+// start of a rule
+static thread_local int previous;
 
 // --------------------------------------------------------------------------
+// Compression is in two parts: the walk of the grammar (forget(),
+// rules::output2(), encode_rule(), encode_symbol()), which decides what is
+// sent, and deletes rules as it goes; and the coder (code()), which codes
+// what is sent in the contexts. The walk hands each step to the coder as
+// an event, which with -f -j 2 is passed through a queue to a thread of
+// its own, so that coding goes on while the next symbols are read and
+// added to the grammar. The events carry all that the coder needs, so it
+// never looks at the grammar, which the walk changes.
+// --------------------------------------------------------------------------
+
+enum { SEND_TERMINAL,          // a: terminal
+       SEND_RULE,              // a: code of the rule, b: keep index
+       SEND_RULE_START,        // a: code of the new rule, b: its length
+       SEND_RULE_END,          // a: code of the rule
+       SEND_CHARACTER,         // a: character of a token's spelling
+       SEND_STOP_FORGETTING,
+       SEND_END_OF_FRAME,
+       SEND_END };
+
+struct event {
+  uint32_t kind, a, b;
+};
+
+// The queue of events to the coder thread. There is one writer, the walk,
+// and one reader, the coder, so the ring needs no lock: only the writer
+// moves 'tail' and only the reader 'head'. Each side works from its own
+// copy of the other's index, and publishes its own every EVENT_BATCH
+// events, so that they seldom touch the same cache line. A side that finds
+// the ring empty, or full, sleeps until the other publishes. It is only
+// woken once WAKE events are waiting for it, or there is room for WAKE
+// more (or at the end of a frame, or of the file), so that the two do not
+// take turns at every batch.
+class event_queue {
+  enum { SIZE = 1 << 16, EVENT_BATCH = 256, WAKE = SIZE / 8 };
+
+  vector<event> ring;
+  atomic<size_t> head, tail;
+  atomic<bool> reader_waiting, writer_waiting;
+  mutex lock;
+  condition_variable published;
+
+  size_t write, head_seen;               // the writer's
+  size_t read, tail_seen;                // the reader's
+
+  void wake_writer(bool now) {
+    if (writer_waiting.load() && (now || tail.load() - read <= SIZE - WAKE)) {
+      lock_guard<mutex> l(lock);
+      published.notify_all();
+    }
+  }
+
+public:
+  void start() {
+    ring.resize(SIZE);
+    head = tail = 0;
+    reader_waiting = writer_waiting = false;
+    write = head_seen = read = tail_seen = 0;
+  }
+
+  // Make the events written so far visible to the reader, and wake it if
+  // it is waiting for them.
+  void flush(bool now = true) {
+    tail.store(write);
+    if (reader_waiting.load() && (now || write - head.load() >= WAKE)) {
+      lock_guard<mutex> l(lock);
+      published.notify_all();
+    }
+  }
+
+  void push(const event &e) {
+    if (write - head_seen == SIZE) {
+      flush();
+      if (write - (head_seen = head.load(memory_order_acquire)) == SIZE) {
+	unique_lock<mutex> l(lock);
+	writer_waiting = true;
+	while (write - (head_seen = head.load()) == SIZE) published.wait(l);
+	writer_waiting = false;
+      }
+    }
+    ring[write ++ & (SIZE - 1)] = e;
+    if (write % EVENT_BATCH == 0) flush(false);
+  }
 
-// Initialize compression or decompression. Create the contexts, start
-// writing or reading the compressed file.
+  event pop() {
+    if (read == tail_seen &&
+	read == (tail_seen = tail.load(memory_order_acquire))) {
+      head.store(read);
+      wake_writer(true);
+      unique_lock<mutex> l(lock);
+      reader_waiting = true;
+      while (read == (tail_seen = tail.load())) published.wait(l);
+      reader_waiting = false;
+    }
+    event e = ring[read ++ & (SIZE - 1)];
+    if (read % EVENT_BATCH == 0) {
+      head.store(read);
+      wake_writer(false);
+    }
+    return e;
+  }
+};
+
+static event_queue events;
+static thread *coder_thread;
+
+// whether events go to the coder thread, rather than straight to code()
+static thread_local bool pipelined;
+
+// what the header of a compressed file holds
+struct file_header {
+  bool all_input_read;
+  int min_terminal, max_terminal, max_rule_len;
+};
+
+// Initialize compression. Create the contexts, start writing the
+// compressed file.
 //
-// Parameter (all_input_read): A boolean value. NOTE: This has a meaning
-// only only in the case of compression. For decompression, it makes no
-// difference whether you call start_compress(true) or
-// start_compress(false).
+// Parameter (all_input_read): A boolean value.
 //
 //   false : start_compress() is being called in the middle of reading the
 //   input, in order to respect a memory limit. 'symbol' and 'lengths'
 //   contexts will be of type DYNAMIC (which allows for escape codes if
 //   coding an unknown symbol is attempted - we will need this to code
 //   symbols and rule lengths that are yet to appear in the grammar).
+//   With -j 2, the coder is started on a thread of its own.
 //
 //   true : start_compress() is being called after all the input has been
 //   read.  'symbol' and 'lengths' contexts will be of type STATIC (which
@@ -98,10 +342,73 @@ extern int compress;
 //   same number of symbols).
 //
 // --------------------------------------------------------------------------
+static thread_local int forgetting;
+
+thread_local int current_rule;
+static thread_local int current_rule_index;
+
+static void start_coder(file_header h);
+static void code(const event &e);
+
+static void run_coder(file_header h)
+{
+  event e;
+
+  encoding = true;
+  start_coder(h);
+  do {
+    e = events.pop();
+    code(e);
+  } while (e.kind != SEND_END);
+}
+
+// Start on a new grammar, and a new stream, to be written or read.
+static void start_stream(bool writing)
+{
+  encoding = writing;
+  forgetting = 1;
+  current_rule = FIRST_RULE;
+  current_rule_index = 0;
+  spelled.clear();
+}
+
 void start_compress(bool all_input_read)
+{
+  file_header h;
+  sequitur::Grammar *g = sequitur::current;
+
+  start_stream(true);
+  h.all_input_read = all_input_read;
+  h.min_terminal = TERM_TO_CODE(g->min_terminal_value());
+  h.max_terminal = TERM_TO_CODE(g->max_terminal_value());
+  h.max_rule_len = g->longest_rule();
+
+  pipelined = !all_input_read && threads > 1;
+  if (pipelined) {
+    events.start();
+    coder_thread = new thread(run_coder, h);
+    return;
+  }
+
+  start_coder(h);
+}
+
+// A stream that could not have been written by the compressor: stop, rather
+// than follow codes that lead outside the grammar read so far.
+static void corrupt()
+{
+  bitio_error("Corrupt input file");
+}
+
+// Start the coder of compression, which writes header h, or of
+// decompression, which reads it.
+static void start_coder(file_header h)
 {
   int i;
-  extern int min_terminal, max_terminal, max_rule_len;
+
+  forgetting = 1;
+  previous = -1;
+  follower_entries = 0;
 
   keep = create_context(KEEPI_LENGTH, STATIC);
   install_symbol(keep, KEEPI_NO);
@@ -111,98 +418,320 @@ void start_compress(bool all_input_read)
   binary_context *file_type = create_binary_context();
   int context_type;
 
-  if (compress) {
+  if (encoding) {
 
     // this is specific to compression
 
-    startoutputtingbits();
-    start_encode();
+    startoutputtingbits(&stream.io);
+    int o = given ? given->order : order;
+    model = (o == 1 ? MODEL_ORDER1 : 0) | (tokens ? MODEL_TOKENS : 0);
+    write_coder(&stream, given ? given->coder : coder, model);
+    start_encode(&stream);
 
-    binary_encode(file_type, all_input_read);
-    context_type = all_input_read ? STATIC : DYNAMIC;
+    binary_encode(&stream, file_type, h.all_input_read);
+    streamed = streaming;
+    binary_encode(&stream, file_type, streamed);
+    context_type = h.all_input_read ? STATIC : DYNAMIC;
 
-    min_terminal = TERM_TO_CODE(min_terminal);
-    max_terminal = TERM_TO_CODE(max_terminal);
+    min_terminal = h.min_terminal;
+    max_terminal = h.max_terminal;
+    max_rule_len = h.max_rule_len;
 
-    arithmetic_encode(min_terminal, min_terminal + 1, MINMAXTERM_TARGET);
-    arithmetic_encode(max_terminal, max_terminal + 1, MINMAXTERM_TARGET);
-    arithmetic_encode(max_rule_len, max_rule_len + 1, MAXRULELEN_TARGET);
+    arithmetic_encode(&stream, min_terminal, min_terminal + 1,
+		      MINMAXTERM_TARGET);
+    arithmetic_encode(&stream, max_terminal, max_terminal + 1,
+		      MINMAXTERM_TARGET);
+    arithmetic_encode(&stream, max_rule_len, max_rule_len + 1,
+		      MAXRULELEN_TARGET);
 
   }
   else {
 
     // this is specific to decompression
 
-    startinputtingbits();
-    start_decode();
-
-    context_type = binary_decode(file_type) ? STATIC : DYNAMIC;
-
-    min_terminal = arithmetic_decode_target(MINMAXTERM_TARGET);
-    arithmetic_decode(min_terminal, min_terminal + 1, MINMAXTERM_TARGET);
-    max_terminal = arithmetic_decode_target(MINMAXTERM_TARGET);
-    arithmetic_decode(max_terminal, max_terminal + 1, MINMAXTERM_TARGET);
-    max_rule_len = arithmetic_decode_target(MAXRULELEN_TARGET);
-    arithmetic_decode(max_rule_len, max_rule_len + 1, MAXRULELEN_TARGET);
+    startinputtingbits(&stream.io);
+    model = read_coder(&stream);
+    if (model & ~MODEL_KNOWN) {
+      char message[64];
+      snprintf(message, sizeof(message),
+	       "Compressed with an unknown model (%d)", model);
+      bitio_error(message);
+    }
+    // files of before the header do not say; -u had to be told
+    if (stream.version == 0 && tokens) model |= MODEL_TOKENS;
+    if (tokens && !(model & MODEL_TOKENS))
+      bitio_error("Not compressed with --tokens or -w");
+    start_decode(&stream);
+
+    context_type = binary_decode(&stream, file_type) ? STATIC : DYNAMIC;
+    streamed = stream.version > 0 ? binary_decode(&stream, file_type) : 0;
+
+    min_terminal = arithmetic_decode_target(&stream, MINMAXTERM_TARGET);
+    arithmetic_decode(&stream, min_terminal, min_terminal + 1,
+		      MINMAXTERM_TARGET);
+    max_terminal = arithmetic_decode_target(&stream, MINMAXTERM_TARGET);
+    arithmetic_decode(&stream, max_terminal, max_terminal + 1,
+		      MINMAXTERM_TARGET);
+    max_rule_len = arithmetic_decode_target(&stream, MAXRULELEN_TARGET);
+    arithmetic_decode(&stream, max_rule_len, max_rule_len + 1,
+		      MAXRULELEN_TARGET);
+    if (max_terminal < min_terminal) corrupt();
   }
 
-  symbol = create_context(SPECIAL_SYMBOLS + max_terminal - min_terminal + 1,
+  int specials = stream.version > 0 ? SPECIAL_SYMBOLS : OLD_SPECIAL_SYMBOLS;
+  symbol = create_context(specials + max_terminal - min_terminal + 1,
 			  context_type);
   install_symbol(symbol, START_RULE);
   install_symbol(symbol, END_OF_FILE);
   install_symbol(symbol, STOP_FORGETTING);
+  if (streamed) install_symbol(symbol, END_OF_FRAME);
   for (i = min_terminal; i <= max_terminal; i+=2) install_symbol(symbol, i);
 
   lengths = create_context(max_rule_len, context_type);
   for (i = 2; i <= max_rule_len; i++) install_symbol(lengths, i);
 
+  if (model & MODEL_TOKENS) {
+    spelling = create_context(END_OF_TOKEN + 1, STATIC);
+    for (i = 0; i <= END_OF_TOKEN; i++) install_symbol(spelling, i);
+  }
+
+  free(file_type);
+}
+
+// The followers of terminal code p, or 0 if there is no room for them.
+static followers *followers_of(int p)
+{
+  unordered_map<int, followers>::iterator i = follower_contexts.find(p);
+  if (i != follower_contexts.end()) return &i->second;
+  if (follower_entries >= FOLLOWER_LIMIT) return 0;
+
+  followers &f = follower_contexts[p];
+  f.c = create_context(2, DYNAMIC);
+  install_symbol(f.c, OTHER_FOLLOWER);
+  f.code.push_back(-1);
+  f.uses = f.hits = 0;
+  follower_entries ++;
+  return &f;
+}
+
+// Add terminal 'code' to followers f, if there is room.
+static void add_follower(followers *f, int code)
+{
+  if (follower_entries >= FOLLOWER_LIMIT ||
+      install_symbol(f->c, f->code.size()) != 0) return;
+  f->entry[code] = f->code.size();
+  f->code.push_back(code);
+  follower_entries ++;
+}
+
+// Encode 'code' in the "symbol" context, after the followers of the
+// terminal before it with --order=1. Like encode(), returns NOT_KNOWN for
+// a terminal the "symbol" context has not seen.
+static int encode_code(int code)
+{
+  int p = previous;
+  followers *f;
+
+  previous = code;
+  if (!(model & MODEL_ORDER1) || !IS_TERMINAL_CODE(p) ||
+      !(f = followers_of(p)))
+    return encode(&stream, symbol, code);
+
+  bool terminal = IS_TERMINAL_CODE(code);
+  unordered_map<int, int>::iterator e = f->entry.end();
+  if (terminal) e = f->entry.find(code);
+  bool hit = e != f->entry.end();
+
+  if (FOLLOWERS_USEFUL(f)) {
+    if (hit) {
+      encode(&stream, f->c, e->second);
+      count_follower(f, true);
+      return 0;
+    }
+    // no entry is installed under the next number, so it codes an escape
+    encode(&stream, f->c, terminal ? f->code.size() : OTHER_FOLLOWER);
+  }
+  count_follower(f, hit);
+  if (terminal && !hit) add_follower(f, code);
+  return encode(&stream, symbol, code);
+}
+
+// Decode a code of the "symbol" context, as encode_code() encoded it. A
+// terminal the "symbol" context has not seen is read in full and
+// installed.
+static int decode_code()
+{
+  int p = previous, code;
+  followers *f = 0;
+
+  if ((model & MODEL_ORDER1) && IS_TERMINAL_CODE(p) &&
+      (f = followers_of(p)) && FOLLOWERS_USEFUL(f)) {
+    int e = decode(&stream, f->c);
+    if (e > OTHER_FOLLOWER) {
+      count_follower(f, true);
+      return previous = f->code[e];
+    }
+  }
+
+  code = decode(&stream, symbol);
+  if (code == NOT_KNOWN) {
+    code = arithmetic_decode_target(&stream, MINMAXTERM_TARGET);
+    arithmetic_decode(&stream, code, code + 1, MINMAXTERM_TARGET);
+    install_symbol(symbol, code);
+  }
+  if (stream.version == 0 && code >= OLD_FIRST_TERMINAL && IS_TERMINAL(code))
+    code += FIRST_TERMINAL - OLD_FIRST_TERMINAL;
+
+  if (f) {
+    bool terminal = IS_TERMINAL_CODE(code);
+    bool hit = terminal && f->entry.count(code);
+    count_follower(f, hit);
+    if (terminal && !hit) add_follower(f, code);
+  }
+  return previous = code;
+}
+
+// Free the contexts of the coder.
+static void free_coder()
+{
+  free_context(symbol);
+  free_context(lengths);
+  free_context(keep);
+  free_context(spelling);
+  symbol = lengths = keep = spelling = 0;
+
+  for (unordered_map<int, followers>::iterator i = follower_contexts.begin();
+       i != follower_contexts.end(); i ++)
+    free_context(i->second.c);
+  follower_contexts.clear();
+}
+
+// Code an event of the walk.
+static void code(const event &e)
+{
+  switch (e.kind) {
+  case SEND_TERMINAL: {
+    int code = TERM_TO_CODE(e.a);
+    // a terminal not yet known is added to the context
+    if (encode_code(code) == NOT_KNOWN) {
+      arithmetic_encode(&stream, code, code + 1, MINMAXTERM_TARGET);
+      install_symbol(symbol, code);
+    }
+    break;
+  }
+
+  case SEND_RULE:
+    encode_code(e.a);
+    if (e.b < KEEPI_LENGTH && forgetting) {
+      encode(&stream, keep, e.b);
+      if (e.b == KEEPI_NO || e.b == KEEPI_DUMMY) delete_symbol(symbol, e.a);
+    }
+    break;
+
+  case SEND_RULE_START:
+    encode_code(START_RULE);
+    install_symbol(symbol, e.a);
+    previous = -1;
+    if (encode(&stream, lengths, e.b) == NOT_KNOWN)
+      arithmetic_encode(&stream, e.b, e.b + 1, MAXRULELEN_TARGET);
+    break;
+
+  case SEND_RULE_END:
+    previous = e.a;
+    break;
+
+  case SEND_CHARACTER:
+    encode(&stream, spelling, e.a);
+    break;
+
+  case SEND_STOP_FORGETTING:
+    encode_code(STOP_FORGETTING);
+    forgetting = 0;
+    break;
+
+  case SEND_END_OF_FRAME:
+    encode_code(END_OF_FRAME);
+    finish_encode(&stream);
+    doneoutputtingbits(&stream.io);
+    bitio_flush(&stream.io);
+    startoutputtingbits(&stream.io);
+    start_encode(&stream);
+    break;
+
+  case SEND_END:
+    encode_code(END_OF_FILE);
+    finish_encode(&stream);
+    doneoutputtingbits(&stream.io);
+    bitio_close(&stream.io);
+    free_coder();
+    break;
+  }
 }
 
-static int forgetting = 1;
+static inline void send(uint32_t kind, uint32_t a = 0, uint32_t b = 0)
+{
+  event e = { kind, a, b };
+  if (pipelined) events.push(e);
+  else code(e);
+}
 
 // Tell the encoder/decoder that no more rules will be deleted from memory.
 void stop_forgetting()
 {
-  encode(symbol, STOP_FORGETTING);
+  send(SEND_STOP_FORGETTING);
   forgetting = 0;
 }
 
+// End a frame of a streamed file: everything encoded so far is written
+// out, so that the decoder can reproduce the input up to here without
+// waiting for more. The coder starts afresh, but the grammar and the
+// contexts are kept, so frames are not independent of each other.
+void end_frame()
+{
+  send(SEND_END_OF_FRAME);
+  if (pipelined) events.flush();
+}
+
 // Finish compression or decompression.
 void end_compress() {
-  if (compress) {
-    encode(symbol, END_OF_FILE);
-    finish_encode();
-    doneoutputtingbits();
+  if (encoding) {
+    send(SEND_END);
+    if (pipelined) {
+      events.flush();
+      coder_thread->join();
+      delete coder_thread;
+      pipelined = false;
+    }
   }
   else {
-    finish_decode();
-    doneinputtingbits();
+    finish_decode(&stream);
+    doneinputtingbits(&stream.io);
+    bitio_close(&stream.io);
+    free_coder();
   }
 }
 
-int current_rule = FIRST_RULE;
-static int current_rule_index = 0;
-
 // Encode a rule whose right-hand side has already been encoded.
 void encode_rule(rules *r, int keepi)
 {
-  encode(symbol, r->index());
-  if (keepi < KEEPI_LENGTH && forgetting) {
-    encode(keep, keepi);
-    if (keepi == KEEPI_NO || keepi == KEEPI_DUMMY)
-      delete_symbol(symbol, r->index());
-  }
+  send(SEND_RULE, r->index(), keepi);
 }
 
-// Encode a terminal symbol. If it is a symbol not yet known,
-// it is added to the context.
+// Encode a terminal symbol, and with --tokens, its spelling the first time.
 void encode_symbol(ulong s)
 {
-  int i;
-  s = TERM_TO_CODE(s);
-  if ((i = encode(symbol, s)) == NOT_KNOWN) {
-    arithmetic_encode(s, s + 1, MINMAXTERM_TARGET);
-    install_symbol(symbol, s);
+  send(SEND_TERMINAL, s);
+
+  if (tokens) {
+    if (s >= spelled.size()) spelled.resize(s + 1);
+    if (!spelled[s]) {
+      size_t length;
+      const char *t = token_text(s, length);
+      for (size_t j = 0; j < length; j ++)
+	send(SEND_CHARACTER, (unsigned char) t[j]);
+      send(SEND_CHARACTER, END_OF_TOKEN);
+      spelled[s] = true;
+    }
   }
 }
 
@@ -218,19 +747,14 @@ void rules::output2()
   number = current_rule;
   current_rule += 2;
 
-  encode(symbol, START_RULE);
-  install_symbol(symbol, number);
-
-  int l = 0;
-  for (s = first(); !s->is_guard(); s = s->next()) l ++;
-
-  if (encode(lengths, l) == NOT_KNOWN)
-     arithmetic_encode(l, l + 1, MAXRULELEN_TARGET);
+  send(SEND_RULE_START, number, length());
 
   for (s = first(); !s->is_guard(); s = s->next())
     if (s->non_terminal() && s->rule()->index() == 0) s->rule()->output2();
     else if (s->non_terminal()) encode_rule(s->rule(), KEEPI_LENGTH);
     else encode_symbol(s->value());
+
+  send(SEND_RULE_END, number);
 }
 
 
@@ -242,6 +766,15 @@ void forget(symbols *s)
 {
   rules *r = 0;
 
+  // once forgetting has stopped the grammar does not change any more, so
+  // the symbol is only encoded; the caller releases the memory in bulk
+  if (!forgetting) {
+    if (!s->non_terminal()) encode_symbol(s->value());
+    else if (s->rule()->index() == 0) s->rule()->output2();
+    else encode_rule(s->rule(), KEEPI_YES);
+    return;
+  }
+
   // symbol is non-terminal
   if (s->non_terminal()) {
     r = s->rule();
@@ -279,12 +812,154 @@ void forget(symbols *s)
 
 /************* Decompression functions *********************/
 
-static rules **R;
+// The decoder never changes a rule once it has been read, so rules are not
+// built of symbols and rules objects as the encoder's are. The right-hand
+// sides of all rules are kept one after another in 'body', as
+// arithmetic-coder codes, and rule i is body[rule[i].start] onwards, for
+// rule[i].length symbols. Space of rules deleted by the keep index is
+// reused by later rules of the same length.
+struct rule_body {
+  size_t start;
+  uint32_t length;
+  bool defined;             // read, and not deleted
+};
+
+static thread_local vector<uint32_t> body;
+static thread_local vector<rule_body> rule;
+static thread_local vector<vector<size_t> > free_bodies;  // by length
+
+// Find space in 'body' for a rule of l symbols.
+static size_t new_body(uint32_t l)
+{
+  if (l < free_bodies.size() && !free_bodies[l].empty()) {
+    size_t start = free_bodies[l].back();
+    free_bodies[l].pop_back();
+    return start;
+  }
+  body.resize(body.size() + l);
+  return body.size() - l;
+}
+
+static void delete_body(int r)
+{
+  uint32_t l = rule[r].length;
+  if (l >= free_bodies.size()) free_bodies.resize(l + 1);
+  free_bodies[l].push_back(rule[r].start);
+  rule[r].defined = false;
+}
+
+// The decompressed output, to a file or to memory (see bitio.h).
+static thread_local bitio decoded;
+
+// the rest of a rule being expanded, for each rule it is within
+struct expansion {
+  const uint32_t *next, *end;
+};
+static thread_local vector<expansion> expansion_stack;
+
+// With --range, only part of the output is written: the first 'skipped'
+// symbols are left out, and decompression stops once 'wanted' more have
+// been written.
+static thread_local uint64_t skipped, wanted;
+
+// With --tokens, read the characters of terminal 't', if it is the first
+// time it is seen.
+static void get_spelling(int t)
+{
+  if (!(model & MODEL_TOKENS)) return;
+
+  if (t >= (int) spelled.size()) spelled.resize(t + 1);
+  if (spelled[t]) return;
+
+  // not a local, which a longjmp() from bitio_error() would not free
+  static thread_local string s;
+  int c;
+  s.clear();
+  while ((c = decode(&stream, spelling)) != END_OF_TOKEN) s += char(c);
+  define_token(t, s.data(), s.size());
+  spelled[t] = true;
+}
+
+// Write a token, or a number, to the decompressed output.
+static void write_text(int t)
+{
+  char number[16];
+  const char *s;
+  size_t length;
+
+  if (model & MODEL_TOKENS) s = token_text(t, length);
+  else {
+    length = snprintf(number, sizeof(number), "%d\n", t);
+    s = number;
+  }
+
+  bitio_write(&decoded, s, length);
+}
+
+// Write terminal 't' to the decompressed output.
+static inline void write_terminal(int t)
+{
+  if (skipped) {
+    skipped --;
+    return;
+  }
+  if (wanted == 0) return;
+  wanted --;
+
+  if ((model & MODEL_TOKENS) || numbers) write_text(t);
+  else OUTPUT_CHAR(&decoded, t);
+}
+
+// Write the full expansion of rule r to the decompressed output. Rules
+// within rules are followed with a stack of our own, rather than by
+// recursion, so that deeply nested grammars cannot overflow the call
+// stack; characters are copied to the buffer in a loop of their own.
+static void expand(int r)
+{
+  vector<expansion> &stack = expansion_stack;
+  const uint32_t *s = body.data() + rule[r].start, *end = s + rule[r].length;
+  bool bytes = !(model & MODEL_TOKENS) && !numbers;
+
+  stack.clear();
+  while (wanted) {
+    if (s == end) {
+      if (stack.empty()) break;
+      s = stack.back().next;
+      end = stack.back().end;
+      stack.pop_back();
+    }
+    else if (IS_NONTERMINAL(*s)) {
+      expansion rest = { s + 1, end };
+      stack.push_back(rest);
+      r = CODE_TO_NONTERM(*s);
+      s = body.data() + rule[r].start;
+      end = s + rule[r].length;
+    }
+    else if (bytes && !skipped) {
+      // a run of characters
+      unsigned char *next = decoded.out_next, *output = decoded.out_end;
+      uint64_t left = wanted;
+      do {
+	if (next == output) {
+	  decoded.out_next = next;
+	  OUTPUT_CHAR(&decoded, CODE_TO_TERM(*s));
+	  next = decoded.out_next;
+	  output = decoded.out_end;
+	}
+	else *next ++ = CODE_TO_TERM(*s);
+	s ++;
+      } while (--left && s != end && IS_TERMINAL(*s));
+      decoded.out_next = next;
+      wanted = left;
+    }
+    else write_terminal(CODE_TO_TERM(*s ++));
+  }
+}
 
 // Read a symbol from compressed input and return its arithmetic-coder code.
 int get_symbol()
 {
-   int i = decode(symbol);
+   int i = decode_code();
 
    if (i == START_RULE) {
 
@@ -295,53 +970,79 @@ int get_symbol()
       current_rule += 2;
       // current rule's *grammar* code
       int ix = current_rule_index++;
-      assert(current_rule_index < UNCOMPRESS_RSIZE);
 
-      R[ix] = new rules;
       // add new non-terminal symbol to context
       install_symbol(symbol, n);
+      previous = -1;
 
       // decode rule length
-      int l = decode(lengths);
+      int l = decode(&stream, lengths);
       if (l == NOT_KNOWN) {
-         l = arithmetic_decode_target(MAXRULELEN_TARGET);
-         arithmetic_decode(l, l + 1, MAXRULELEN_TARGET);
+         l = arithmetic_decode_target(&stream, MAXRULELEN_TARGET);
+         arithmetic_decode(&stream, l, l + 1, MAXRULELEN_TARGET);
       }
 
+      // space for the rule's right-hand side is taken before reading it,
+      // as rules defined within it are read first
+      if (ix >= (int) rule.size()) rule.resize(ix + 1);
+      rule[ix].start = new_body(l);
+      rule[ix].length = l;
+      rule[ix].defined = false;
+
       // read rule's right-hand side, symbol by symbol
       for (int j = 0; j < l; j ++) {
          int x = get_symbol();
-         if (IS_NONTERMINAL(x))
-            R[ix]->last()->insert_after(new symbols(R[CODE_TO_NONTERM(x)]));
-         else {
-            if (x == NOT_KNOWN) {
-               x = arithmetic_decode_target(MINMAXTERM_TARGET);
-               arithmetic_decode(x, x + 1, MINMAXTERM_TARGET);
-               install_symbol(symbol, x);
-             }
-            R[ix]->last()->insert_after(new symbols(CODE_TO_TERM(x)));
-         }
+         if (x < SPECIAL_SYMBOLS) corrupt();
+         if (IS_TERMINAL(x)) get_spelling(CODE_TO_TERM(x));
+         body[rule[ix].start + j] = x;
      }
+     rule[ix].defined = true;
+     previous = n;
      return n;
   }
 
-  // other symbol
+  // other symbol: a rule must have been read in full, and not deleted
 
-  else return i;
+  else if (i >= FIRST_RULE && !IS_TERMINAL(i)) {
+    unsigned j = CODE_TO_NONTERM(i);
+    if (j >= rule.size() || !rule[j].defined) corrupt();
+  }
+  return i;
 }
 
 /**** Decompression entry point ****/
 
-// Decompress compressed file.
-void uncompress()
+// Give back n bytes read from standard input, to be decompressed before
+// the rest of it.
+void uncompress_unread(const unsigned char *bytes, int n)
+{
+  bitio_unread(&stream.io, bytes, n);
+}
+
+// Free the rules read, and the buffers of the output; end_compress() has
+// freed those of the input and the contexts, unless decompression stopped
+// with bitio_error() before it.
+static void free_stream()
 {
-  extern int numbers;     // true - we output (terminal) symbol codes in decimal form, one per line; false - as characters
+  bitio_close(&stream.io);
+  bitio_close(&decoded);
+  free_coder();
+  vector<uint32_t>().swap(body);
+  vector<rule_body>().swap(rule);
+  vector<vector<size_t> >().swap(free_bodies);
+}
 
-  R = (rules **) malloc(UNCOMPRESS_RSIZE * sizeof(rules *));
+// Decompress the stream, writing symbols 'offset' to 'offset' + 'length'
+// of it to 'decoded'.
+static void uncompress_stream(uint64_t offset, uint64_t length)
+{
+  skipped = offset;
+  wanted = length;
 
-  start_compress(true);
+  start_stream(false);
+  start_coder(file_header());
 
-  while (1) {
+  while (wanted) {
     int current = current_rule;
 
     // read a symbol
@@ -349,20 +1050,19 @@ void uncompress()
 
     if (i == END_OF_FILE) break;
     else if (i == STOP_FORGETTING) forgetting = 0;
-    // symbol is a yet unknown terminal
-    else if (i == NOT_KNOWN)
-    {
-      int j = arithmetic_decode_target(MINMAXTERM_TARGET);
-      arithmetic_decode(j, j + 1, MINMAXTERM_TARGET);
-      install_symbol(symbol, j);
-
-      cout << char(CODE_TO_TERM(j));
+    // the frame is complete: write it out before reading the next
+    else if (i == END_OF_FRAME) {
+      bitio_flush(&decoded);
+      finish_decode(&stream);
+      doneinputtingbits(&stream.io);
+      startinputtingbits(&stream.io);
+      start_decode(&stream);
     }
-    // symbol is a (known) terminal
+    // symbol is a terminal
     else if (IS_TERMINAL(i))
     {
-      if (numbers) cout <<  int(CODE_TO_TERM(i)) << endl;
-      else         cout << char(CODE_TO_TERM(i));
+      get_spelling(CODE_TO_TERM(i));
+      write_terminal(CODE_TO_TERM(i));
     }
     // symbol is a non-terminal
     else
@@ -371,23 +1071,108 @@ void uncompress()
       // if we are "forgetting rules", non-terminal is followed
       if (i < current && forgetting) {
 	// by keep index
-        int keepi = decode(keep);
+        int keepi = decode(&stream, keep);
 
 	// reproduce rule's full expansion, unless keep index says not to
-        if (keepi != KEEPI_DUMMY) R[j]->reproduce();
+        if (keepi != KEEPI_DUMMY) expand(j);
 
 	// delete rule from memory, if keep index says so
         if (keepi == KEEPI_NO || keepi == KEEPI_DUMMY) {
            delete_symbol(symbol, i);
-           while (R[j]->first()->next() != R[j]->first()) delete R[j]->first();
-           delete R[j];
+           delete_body(j);
         }
       }
       // we are not "forgetting rules", rule is not followed
       // by keep index, just reproduce
-      else R[j]->reproduce();
+      else expand(j);
     }
   }
 
   end_compress();
+  bitio_flush(&decoded);
+  free_stream();
+}
+
+// Decompress the compressed file read from 'in', writing symbols 'offset'
+// to 'offset' + 'length' of it to 'out'.
+void uncompress(FILE *in, FILE *out, uint64_t offset, uint64_t length)
+{
+  bitio_files(&stream.io, in, 0);
+  bitio_files(&decoded, 0, out);
+  uncompress_stream(offset, length);
+}
+
+
+/************* In memory *********************/
+
+// append the bytes given to a bitio_callbacks() writer to the vector 'arg'
+static void append_bytes(void *arg, const unsigned char *bytes, size_t n)
+{
+  vector<uint8_t> *out = (vector<uint8_t> *) arg;
+  out->insert(out->end(), bytes, bytes + n);
+}
+
+// Compress grammar g, which has all of its input, and append the
+// compressed file to 'out'. If the input was empty, g holds only a
+// stand-in symbol (see empty_input() in sequitur.cc), which is not sent.
+void compress_grammar(sequitur::Grammar &g, vector<uint8_t> &out,
+		      bool empty)
+{
+  bitio_callbacks(&stream.io, 0, append_bytes, &out);
+
+  start_compress(true);
+  stop_forgetting();
+  rules *S = g.start();
+  if (!empty)
+    for (symbols *s = S->first(); !s->is_guard(); s = s->next())
+      forget(s);
+  end_compress();
+}
+
+// Decompress the compressed file of 'size' bytes at 'in', appending
+// symbols 'offset' to 'offset' + 'length' of it to 'out'.
+void uncompress_memory(const void *in, size_t size, vector<uint8_t> &out,
+		       uint64_t offset, uint64_t length)
+{
+  bitio_memory_input(&stream.io, in, size);
+  bitio_callbacks(&decoded, 0, append_bytes, &out);
+  uncompress_stream(offset, length);
+}
+
+namespace sequitur {
+
+void compress(const void *in, size_t size, vector<uint8_t> &out,
+	      const options &o)
+{
+  const unsigned char *bytes = (const unsigned char *) in;
+  vector<uint32_t> symbols(bytes, bytes + size);
+
+  if (size == 0) symbols.push_back(-1);
+  Grammar g(o.k, o.delimiter, o.memory_to_use, true);
+  g.append(symbols.data(), symbols.size());
+  given = &o;
+  compress_grammar(g, out, size == 0);
+  given = 0;
+}
+
+// Errors in the input come back here from bitio_error(), rather than
+// exiting, and what was appended to 'out' is taken off again. Nothing
+// between here and bitio_error() has a destructor to run.
+bool decompress(const void *in, size_t size, vector<uint8_t> &out)
+{
+  size_t had = out.size();
+  jmp_buf failed;
+  jmp_buf *before = bitio_catch(&failed);
+
+  if (setjmp(failed)) {
+    bitio_catch(before);
+    free_stream();
+    out.resize(had);
+    return false;
+  }
+  uncompress_memory(in, size, out, 0, UINT64_MAX);
+  bitio_catch(before);
+  return true;
+}
+
 }
@@ -0,0 +1,51 @@
+/****************************************************************************
+
+ compress.h - Compression and decompression in memory, for programs that
+              want to compress records of their own without going through
+              files or pipes.
+
+ The bytes of the input are the symbols, as sequitur -c reads them without
+ -d, -w or --tokens. The grammar and the coder are those of the options
+ given, which start out as sequitur's defaults. The compressed output is
+ the file sequitur -c writes, and can be read back with sequitur -u. Each
+ thread can compress or decompress on its own.
+
+****************************************************************************/
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace sequitur {
+
+// the options of sequitur -c of the same names
+struct options {
+  int k;               // -k: times a digram occurs before it forms a rule
+  int delimiter;       // -e: symbol that no rule is formed across, or -1
+  long memory_to_use;  // -m, in bytes: upper limit on the hash table
+  int coder;           // --coder: one of those below
+  int order;           // --order: 0, or 1 to code each terminal in the
+		       // context of the terminal before it
+
+  // the coders, numbered as in the header of the file (see arith.h)
+  enum { arithmetic, range, rans };
+
+  options() : k(2), delimiter(-1), memory_to_use(1000000000),
+	      coder(arithmetic), order(0) {}
+};
+
+// compress the 'size' bytes at 'in', appending the compressed file to 'out'
+void compress(const void *in, size_t size, std::vector<uint8_t> &out,
+	      const options &o = options());
+
+// decompress the compressed file of 'size' bytes at 'in', appending the
+// bytes to 'out'; false, with 'out' as it was, if it is not a compressed
+// file, or is cut short or corrupt
+bool decompress(const void *in, size_t size, std::vector<uint8_t> &out);
+
+}
+
+#endif
@@ -0,0 +1,34 @@
+#!/usr/bin/perl -w
+
+# Compression of the test files when the output is written in frames
+# (--frame-size), against the size of the frames: the smaller they are, the
+# less input waits to be written, and the less the grammar can share
+# between one part of the input and the next.
+
+$sequitur = $ARGV[0] || "./sequitur";
+@files = ("code.input", "exe.input", "random.input");
+
+print "frame size    ";
+foreach $file (@files) { printf "%14s", $file; }
+printf "%14s\n", "all";
+
+foreach $frame_size (0, 65536, 16384, 4096, 1024, 256, 64) {
+    $option = $frame_size ? "--frame-size=$frame_size" : "";
+    printf "%-14s", $frame_size ? $frame_size : "none";
+
+    $total_in = $total_out = 0;
+    foreach $file (@files) {
+	system("$sequitur -cq $option < testfiles/$file > /tmp/$$.compressed");
+	system("$sequitur -uq < /tmp/$$.compressed | cmp -s - testfiles/$file")
+	    == 0 or die "$file does not decompress with $option\n";
+
+	$in = -s "testfiles/$file";
+	$out = -s "/tmp/$$.compressed";
+	$total_in += $in;
+	$total_out += $out;
+	printf "%10.2f bpc", $out / $in * 8;
+    }
+    printf "%10.2f bpc\n", $total_out / $total_in * 8;
+}
+
+unlink "/tmp/$$.compressed";
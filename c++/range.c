@@ -0,0 +1,195 @@
+/******************************************************************************
+File:		range.c
+
+Purpose:	A byte-oriented range coder, an alternative to the arithmetic
+		coder of arith.c (sequitur -c --coder=range).
+
+Based on:	D. Subbotin, carryless range coder (1999), with 64 bits of
+		state.
+
+ ************************************************************************
+
+  The coder of arith.c keeps 32 bits of range and puts out one bit at a
+time as the range is doubled, with follow bits to settle carries. Here low
+and range are 64 bits, and the range is scaled by 256, a byte at a time,
+once the top byte of the interval is settled. A carry is never needed:
+when the interval straddles a byte boundary and the range has got small,
+the range is cut back to end at the boundary, which costs a little code
+space, now and then.
+
+  The range is kept at 2^48 or more, so with totals of up to 2^F_BITS
+the division R/total loses nothing that matters, and the ratio is as
+good as that of arith.c. As there, the excess code range left over by the
+division goes to the symbol at the end of the frequency range, where
+stats.c puts the most probable symbol.
+
+  The functions are called through those of arith.c, which pass each call
+on to these when the coder in use (the type of the coder, see arith.h) is
+RANGE_CODER; its state is kept in the range part of the coder.
+
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "arith.h"
+#include "bitio.h"
+
+#define TOP	((code64) 1 << 56)	/* the top byte is settled below this */
+#define BOTTOM	((code64) 1 << 48)	/* least range after renormalising */
+
+
+/*
+ * Put out the settled top bytes of low, until the range is more than
+ * BOTTOM again.
+ */
+#define ENCODE_RENORMALISE						\
+do {									\
+    while ((cs->range.out_low ^						\
+	    (cs->range.out_low + cs->range.out_range)) < TOP ||		\
+	   (cs->range.out_range < BOTTOM &&				\
+	    ((cs->range.out_range = -cs->range.out_low & (BOTTOM - 1)),	\
+	     1)))							\
+    {									\
+	OUTPUT_BYTE(&cs->io, (int) (cs->range.out_low >> 56));		\
+	cs->range.out_low <<= 8;					\
+	cs->range.out_range <<= 8;					\
+    }									\
+} while (0)
+
+#define DECODE_RENORMALISE						\
+do {									\
+    while ((cs->range.in_low ^						\
+	    (cs->range.in_low + cs->range.in_range)) < TOP ||		\
+	   (cs->range.in_range < BOTTOM &&				\
+	    ((cs->range.in_range = -cs->range.in_low & (BOTTOM - 1)),	\
+	     1)))							\
+    {									\
+	cs->range.in_code = (cs->range.in_code << 8) | next_byte(cs);	\
+	cs->range.in_low <<= 8;						\
+	cs->range.in_range <<= 8;					\
+    }									\
+} while (0)
+
+/*
+ * The decoder reads exactly the bytes the encoder wrote, so reading past
+ * the end of the input means that it is cut short.
+ */
+static int next_byte(coder_state *cs)
+{
+    int c = INPUT_BYTE(&cs->io);
+
+    if (c == EOF)
+	bitio_error("Bad input file - attempted read past end of file.");
+    return c;
+}
+
+
+void range_encode(coder_state *cs, freq_value low, freq_value high,
+                  freq_value total)
+{
+    code64 r = cs->range.out_range / total;
+    code64 temp = r * low;
+
+    cs->range.out_low += temp;
+    if (high < total)
+	cs->range.out_range = r * (high - low);
+    else
+	cs->range.out_range -= temp;	/* give the symbol the excess range */
+
+    ENCODE_RENORMALISE;
+}
+
+freq_value range_decode_target(coder_state *cs, freq_value total)
+{
+    code64 target;
+
+    cs->range.in_r = cs->range.in_range / total;
+    target = (cs->range.in_code - cs->range.in_low) / cs->range.in_r;
+    return (target >= total ? total - 1 : (freq_value) target);
+}
+
+void range_decode(coder_state *cs, freq_value low, freq_value high,
+                  freq_value total)
+{
+    code64 temp = cs->range.in_r * low;
+
+    cs->range.in_low += temp;
+    if (high < total)
+	cs->range.in_range = cs->range.in_r * (high - low);
+    else
+	cs->range.in_range -= temp;
+
+    DECODE_RENORMALISE;
+}
+
+/*
+ * The binary coders put 0 at the bottom of the range and 1 at the top,
+ * with the excess range.
+ */
+void range_binary_encode(coder_state *cs, freq_value c0, freq_value c1,
+			 int bit)
+{
+    code64 r0 = cs->range.out_range / (c0 + c1) * c0;
+
+    if (bit)
+    {
+	cs->range.out_low += r0;
+	cs->range.out_range -= r0;
+    }
+    else
+	cs->range.out_range = r0;
+
+    ENCODE_RENORMALISE;
+}
+
+int range_binary_decode(coder_state *cs, freq_value c0, freq_value c1)
+{
+    code64 r0 = cs->range.in_range / (c0 + c1) * c0;
+    int bit = cs->range.in_code - cs->range.in_low >= r0;
+
+    if (bit)
+    {
+	cs->range.in_low += r0;
+	cs->range.in_range -= r0;
+    }
+    else
+	cs->range.in_range = r0;
+
+    DECODE_RENORMALISE;
+    return bit;
+}
+
+void range_start_encode(coder_state *cs)
+{
+    cs->range.out_low = 0;
+    cs->range.out_range = ~(code64) 0;
+}
+
+/*
+ * Put out all of low, so that the decoder, which reads eight bytes
+ * ahead, reads no further than the end of the stream. Each frame of a
+ * streamed file (end_frame() in compress.cc) then starts on a byte of its
+ * own.
+ */
+void range_finish_encode(coder_state *cs)
+{
+    int i;
+
+    for (i = 0; i < 8; i++)
+    {
+	OUTPUT_BYTE(&cs->io, (int) (cs->range.out_low >> 56));
+	cs->range.out_low <<= 8;
+    }
+}
+
+void range_start_decode(coder_state *cs)
+{
+    int i;
+
+    cs->range.in_low = 0;
+    cs->range.in_range = ~(code64) 0;
+    cs->range.in_code = 0;
+    for (i = 0; i < 8; i++)
+	cs->range.in_code = (cs->range.in_code << 8) | next_byte(cs);
+}
+
@@ -0,0 +1,219 @@
+/******************************************************************************
+File:		rans.c
+
+Purpose:	An rANS coder (range variant of asymmetric numeral systems),
+		the third coder sequitur can write with (--coder=rans).
+
+Based on:	J. Duda, "Asymmetric numeral systems: entropy coding
+		combining speed of Huffman coding with compression rate of
+		arithmetic coding", arXiv:1311.2540, 2013; and F. Giesen's
+		rANS with 64-bit state and 32-bit renormalisation.
+
+ ************************************************************************
+
+  The state of the coder is a single number x, kept in [2^31, 2^63). A
+symbol with frequency f, at cumulative frequency c out of a total of
+M = 2^31, is coded as
+
+	x' = (x / f) * M + c + x % f
+
+and decoded by taking the slot x' % M, which falls in [c, c + f), and
+inverting the above. Words of 32 bits are moved out of (or into) the
+state to keep it in range.
+
+  The frequencies of stats.c are adaptive, and their total is not a power
+of two, so each interval [low, high) out of 'total' is scaled to
+[g(low), g(high)) out of M, with g(c) = c * M / total. As total <= M, g is
+strictly increasing, so no symbol is left with no slots. The decoder finds
+the frequency a slot y belongs to without a search:
+
+	largest c with g(c) <= y  is  ((y + 1) * total - 1) / M
+
+  The decoder takes symbols off in the reverse of the order the encoder
+put them on, so the encoder keeps the scaled intervals of a segment of
+up to SEGMENT symbols, and codes them backwards when the segment is full,
+or at finish_encode(). Within a segment, symbols take turns between two
+states, so that the work of decoding one is not held up waiting for the
+last. A segment is written as the final two states and then the words, in
+the order the decoder reads them; the decoder reads a segment's states
+when it comes to its first symbol, so that nothing is read past the end
+of a frame before the frame has been decoded.
+
+  The functions are called through those of arith.c, when the type of the
+coder (see arith.h) is RANS_CODER; its state is kept in the rans part of
+the coder.
+
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "arith.h"
+#include "bitio.h"
+
+#define SCALE_BITS	31
+#define M		((code64) 1 << SCALE_BITS)	/* total of the slots */
+#define L		((code64) 1 << 31)		/* least state */
+#define STATES		RANS_STATES			/* interleaved */
+#define SEGMENT		65536				/* symbols */
+
+
+/* scale frequency c out of total to a slot out of M */
+#define SCALE(c, total)		((unsigned int) (((code64) (c) << SCALE_BITS) \
+						 / (total)))
+
+static void put_word(coder_state *cs, unsigned int w)
+{
+    int i;
+
+    for (i = 0; i < 4; i++)
+	OUTPUT_BYTE(&cs->io, (w >> (8 * i)) & 0xff);
+}
+
+/*
+ * The decoder reads exactly the bytes the encoder wrote, so reading past
+ * the end of the input means that it is cut short.
+ */
+static unsigned int get_word(coder_state *cs)
+{
+    unsigned int w = 0;
+    int i, c;
+
+    for (i = 0; i < 4; i++)
+    {
+	if ((c = INPUT_BYTE(&cs->io)) == EOF)
+	    bitio_error("Bad input file - attempted read past end of file.");
+	w |= (unsigned int) c << (8 * i);
+    }
+    return w;
+}
+
+
+/*
+ * Code the symbols of the segment, last first, and write it out.
+ */
+static void flush_segment(coder_state *cs)
+{
+    code64 x[STATES];
+    unsigned int *word = cs->rans.out_words + SEGMENT; /* filled downwards */
+    int i;
+
+    if (cs->rans.out_count == 0)
+	return;
+
+    for (i = 0; i < STATES; i++)
+	x[i] = L;
+
+    for (i = cs->rans.out_count - 1; i >= 0; i--)
+    {
+	code64 *s = &x[i % STATES];
+	code64 f = cs->rans.out_freq[i];
+
+	if (*s >= (((L >> SCALE_BITS) << 32) * f))
+	{
+	    *--word = (unsigned int) *s;
+	    *s >>= 32;
+	}
+	*s = ((*s / f) << SCALE_BITS) + (*s % f) + cs->rans.out_start[i];
+    }
+
+    for (i = 0; i < STATES; i++)
+    {
+	put_word(cs, (unsigned int) x[i]);
+	put_word(cs, (unsigned int) (x[i] >> 32));
+    }
+    for (; word < cs->rans.out_words + SEGMENT; word++)
+	put_word(cs, *word);
+
+    cs->rans.out_count = 0;
+}
+
+void rans_encode(coder_state *cs, freq_value low, freq_value high,
+                 freq_value total)
+{
+    unsigned int start = SCALE(low, total);
+
+    cs->rans.out_start[cs->rans.out_count] = start;
+    cs->rans.out_freq[cs->rans.out_count] = SCALE(high, total) - start;
+    if (++cs->rans.out_count == SEGMENT)
+	flush_segment(cs);
+}
+
+freq_value rans_decode_target(coder_state *cs, freq_value total)
+{
+    if (cs->rans.in_count == 0)
+    {
+	int i;
+
+	for (i = 0; i < STATES; i++)
+	{
+	    cs->rans.in_x[i] = get_word(cs);
+	    cs->rans.in_x[i] |= (code64) get_word(cs) << 32;
+	}
+    }
+
+    cs->rans.in_slot = cs->rans.in_x[cs->rans.in_count % STATES] & (M - 1);
+    return (freq_value) (((cs->rans.in_slot + 1) * total - 1)
+			 >> SCALE_BITS);
+}
+
+void rans_decode(coder_state *cs, freq_value low, freq_value high,
+                 freq_value total)
+{
+    code64 *s = &cs->rans.in_x[cs->rans.in_count % STATES];
+    unsigned int start = SCALE(low, total);
+
+    *s = (SCALE(high, total) - start) * (*s >> SCALE_BITS)
+	+ cs->rans.in_slot - start;
+    if (*s < L)
+	*s = (*s << 32) | get_word(cs);
+
+    if (++cs->rans.in_count == SEGMENT)
+	cs->rans.in_count = 0;
+}
+
+/*
+ * Binary symbols are coded as any other, 0 at the bottom of the range.
+ */
+void rans_binary_encode(coder_state *cs, freq_value c0, freq_value c1,
+			int bit)
+{
+    if (bit)
+	rans_encode(cs, c0, c0 + c1, c0 + c1);
+    else
+	rans_encode(cs, 0, c0, c0 + c1);
+}
+
+int rans_binary_decode(coder_state *cs, freq_value c0, freq_value c1)
+{
+    int bit = rans_decode_target(cs, c0 + c1) >= c0;
+
+    if (bit)
+	rans_decode(cs, c0, c0 + c1, c0 + c1);
+    else
+	rans_decode(cs, 0, c0, c0 + c1);
+    return bit;
+}
+
+void rans_start_encode(coder_state *cs)
+{
+    cs->rans.out_start =
+	(unsigned int *) malloc(SEGMENT * sizeof(unsigned int));
+    cs->rans.out_freq =
+	(unsigned int *) malloc(SEGMENT * sizeof(unsigned int));
+    cs->rans.out_words =
+	(unsigned int *) malloc(SEGMENT * sizeof(unsigned int));
+    cs->rans.out_count = 0;
+}
+
+void rans_finish_encode(coder_state *cs)
+{
+    flush_segment(cs);
+    free(cs->rans.out_start);
+    free(cs->rans.out_freq);
+    free(cs->rans.out_words);
+}
+
+void rans_start_decode(coder_state *cs)
+{
+    cs->rans.in_count = 0;
+}
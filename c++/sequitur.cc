@@ -6,6 +6,9 @@
     main() function contains: command line options parsing,
     program initialization, reading the input...
 
+    The grammar itself is built by sequitur::Grammar (classes.h), which is
+    also available on its own as libsequitur.a .
+
  Compilation notes:
     Define PLATFORM_MSWIN macro if compiling this program under Windows,
     or PLATFORM_UNIX if compiling it under Unix/Linux.
@@ -19,52 +22,81 @@
  ***************************************************************************/
 
 
-#ifdef PLATFORM_MSWIN
-#include <fcntl.h>    // for O_BINARY
-#endif
-
+#include <fcntl.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include <sys/timeb.h>
 
 #ifdef PLATFORM_UNIX
+#include <sys/mman.h>
+#include <poll.h>
 #include <sys/times.h>
+#include <time.h>
 #endif
 
 #include <limits.h>
+#include <ctype.h>
+#include <thread>
+#include <vector>
 #include "classes.h"
+#include "tokens.h"
 
-using namespace std;
+extern "C" {
+#include "arith.h"
+}
 
-rules *S;                 // pointer to main rule of the grammar
+#ifdef PLATFORM_UNIX
+#include <getopt.h>
+#endif
+
+using namespace std;
 
-int num_rules = 0;        // number of rules in the grammar
-int num_symbols = 0;      // number of symbols in the grammar
-int min_terminal,         // minimum and maximum value among terminal symbols
-    max_terminal;         //
-int max_rule_len = 2;     // maximum rule length
 bool compression_initialized = false;
 
+// whether the input was empty; the grammar then holds a stand-in symbol
+bool empty_input_read = false;
+
 int compress = 0,
   do_uncompress = 0,
   do_print = 0,
   reproduce = 0,
-  quiet = 0,
   phind = 0,
-  numbers = 0,
+  table_stats = 0,
   print_rule_freq = 0,
   print_rule_usage = 0,
-  delimiter = -1,
-  memory_to_use = 1000000000,
 
-  // minimum number of times a digram must occur to form rule minus one
-  // (e.g. if K is 1, two occurrences are required to form rule)
-    K = 1;
+  // with -b, the input is compressed in blocks of this many symbols
+  block_size = 0,
+
+  // with --frame-size or --frame-ms, the compressed output is written in
+  // frames holding at most this many symbols, or this many milliseconds
+  // of input
+  frame_size = 0,
+  frame_milliseconds = 0;
+
+// the options that compression reads too (defined in compress.cc)
+extern int quiet, numbers, delimiter, k, threads, streaming, coder, order;
+extern long memory_to_use;
+
+// with -u --range, the symbols of the output to write
+uint64_t range_offset = 0, range_length = UINT64_MAX;
 
 char *delimiter_string = 0;
 
-void uncompress(), print(), number(), forget(symbols *s),
-  forget_print(symbols *s);
-void start_compress(bool), end_compress(), stop_forgetting();
+extern thread_local int current_rule;
+
+void uncompress(FILE *in, FILE *out, uint64_t offset, uint64_t length),
+  print(sequitur::Grammar &g), number(sequitur::Grammar &g),
+  forget(symbols *s), forget_print(symbols *s),
+  induce_in_parallel(sequitur::Grammar &g), open_input(const char *name),
+  compress_blocks(int block_size);
+bool uncompress_blocks(uint64_t offset, uint64_t length);
+int read_symbols(uint32_t *buffer, int size);
+bool wait_for_input(long milliseconds);
+uint32_t empty_input();
+void start_compress(bool), end_compress(), stop_forgetting(), end_frame();
+static void send_frame(rules *S);
+static long milliseconds();
 ofstream *rule_S = 0;
 
 #ifdef PLATFORM_MSWIN
@@ -73,14 +105,39 @@ int getopt ( int argc, char **argv, char *optstring );
 }
 #endif
 
+// options that have a long name only
+enum { TOKENS_OPTION = 256, FRAME_SIZE_OPTION, FRAME_MS_OPTION, RANGE_OPTION,
+       CODER_OPTION, ORDER_OPTION };
+
+#ifdef PLATFORM_UNIX
+static struct option long_options[] = {
+  { "tokens", required_argument, 0, TOKENS_OPTION },
+  { "frame-size", required_argument, 0, FRAME_SIZE_OPTION },
+  { "frame-ms", required_argument, 0, FRAME_MS_OPTION },
+  { "range", required_argument, 0, RANGE_OPTION },
+  { "coder", required_argument, 0, CODER_OPTION },
+  { "order", required_argument, 0, ORDER_OPTION },
+  { 0, 0, 0, 0 }
+};
+#endif
+
 const char *help = "\n\
-usage: sequitur -cdpqrtTuz -k <K> -e <delimiter> -f <max symbols> -m <memory_limit>\n\n\
+usage: sequitur -cdpqrstTuz -k <K> -e <delimiter> -f <max symbols> -m <memory_limit>\n\
+                -j <threads> -b <block size> -w <width> --tokens=word|line\n\
+                --frame-size=<symbols> --frame-ms=<milliseconds>\n\
+                --range=<offset>:<length> --coder=arith|range|rans\n\
+                --order=0|1\n\
+                [file]\n\n\
+Reads the file, or standard input if none is given.\n\n\
 -p    print grammar at end\n\
 -d    treat input as symbol numbers, one per line\n\
+-w    treat input as symbol numbers of 2, 4 or 8 bytes, little-endian; -u\n\
+      writes them back in the same form\n\
 -c    compress\n\
 -u    uncompress\n\
--m    use this amount of memory, in MB, for the hash table (default 1000)\n\
+-m    use at most this amount of memory, in MB, for the hash table (default 1000)\n\
 -q    quiet: suppress progress numbers on stderr\n\
+-s    print hash table statistics (occupancy, buckets probed) on stderr\n\
 -r    reproduce full expansion of rules after each rule\n\
 -t    print rule usage in the grammar after each rule\n\
 -T    print rule usage in the input after each rule\n\
@@ -88,9 +145,41 @@ usage: sequitur -cdpqrtTuz -k <K> -e <delimiter> -f <max symbols> -m <memory_lim
 -k    set K, the minmum number of times a digram must occur to form rule\n\
       (default 2)\n\
 -e    set the delimiter symbol. Rules will not be formed across (i.e. \n\
-      including) delimiters. If with -d, 0-9 are treated as numbers\n\
+      including) delimiters. If with -d or -w, 0-9 are treated as numbers\n\
 -f    set maximum symbols in grammar (memory limit). Grammar/compressed output\n\
       will be generated once the grammar reaches this size\n\
+-j    split the input into this many pieces, form the grammar of each on a\n\
+      thread of its own, then merge them (the grammar is a little larger).\n\
+      With -c -f, -j 2 codes the output on a second thread, while the\n\
+      grammar is formed on the first\n\
+-b    with -c, compress blocks of this many symbols each on their own, on\n\
+      as many threads as -j gives, into a container; -u -j decompresses\n\
+      the blocks of a container on that many threads\n\
+--tokens=word\n\
+      form rules of words rather than characters: runs of letters and digits,\n\
+      and the runs of other characters between them. With -e, the delimiter\n\
+      is a word. The compressed file says so, so -u needs no --tokens\n\
+--tokens=line\n\
+      the same, with lines\n\
+--frame-size\n\
+      with -c, write the compressed output in frames, each of which can be\n\
+      decompressed as soon as it is read, every this many input symbols\n\
+--frame-ms\n\
+      the same, once input has waited this long to be written\n\
+--range\n\
+      with -u, write only this many symbols (bytes, or with -d numbers) from\n\
+      this offset on. Only the blocks that hold them are decompressed, if\n\
+      the file was compressed with -b\n\
+--coder=range\n\
+      with -c, write the output with a byte-wise range coder, which is\n\
+      faster than the arithmetic coder (--coder=arith, the default) and\n\
+      compresses nearly as well. -u finds out which was used by itself\n\
+--coder=rans\n\
+      the same, with an rANS coder\n\
+--order=1\n\
+      with -c, code each symbol that follows a terminal in the context of\n\
+      that terminal first, which compresses better and decompresses a\n\
+      little slower. -u finds out by itself (the default is --order=0)\n\
 ";
 
 int main(int argc, char **argv)
@@ -103,9 +192,18 @@ int main(int argc, char **argv)
   // maximum number of symbols that can be held in memory (used with -f option)
   int max_symbols = 0;
 
+  // symbols read, to be added to the grammar
+  enum { BUFFER_SIZE = 4096 };
+  uint32_t buffer[BUFFER_SIZE];
+
   int c;
 
-  while ((c = getopt(argc, argv, "cuk:prf:qzdtTe:hm:")) != -1) {
+#ifdef PLATFORM_UNIX
+  while ((c = getopt_long(argc, argv, "cuk:prf:qszdtTe:hm:j:w:b:", long_options,
+			  0)) != -1) {
+#else
+  while ((c = getopt(argc, argv, "cuk:prf:qszdtTe:hm:j:w:b:")) != -1) {
+#endif
     switch (c) {
       case 'h': cerr << help; exit(2); break;
       case 't': print_rule_freq = 1; break;
@@ -116,22 +214,118 @@ int main(int argc, char **argv)
       case 'p': do_print = 1; break;
       case 'r': reproduce = 1; break;
       case 'q': quiet = 1; break;
+      case 's': table_stats = 1; break;
       case 'z': phind = 1; break;
       case 'e': delimiter_string = optarg; break;
       case 'f': max_symbols = atoi(optarg); break;
-      case 'k': K = atoi(optarg) - 1; break;
-      case 'm': memory_to_use = atoi(optarg) * 1000000; break;
+      case 'k': k = atoi(optarg); break;
+      case 'm': memory_to_use = atol(optarg) * 1000000; break;
+      case 'j': threads = atoi(optarg); break;
+      case 'b': block_size = atoi(optarg); break;
+      case 'w': tokens = FIXED_WIDTH; token_width = atoi(optarg); break;
+      case FRAME_SIZE_OPTION: frame_size = atoi(optarg); break;
+      case FRAME_MS_OPTION: frame_milliseconds = atoi(optarg); break;
+      case RANGE_OPTION: {
+	char *end;
+	range_offset = strtoull(optarg, &end, 10);
+	if (*end != ':' || !isdigit(end[1])) {
+	  cerr << "sequitur: --range must be <offset>:<length>" << endl;
+	  exit(1);
+	}
+	range_length = strtoull(end + 1, 0, 10);
+	break;
+      }
+      case CODER_OPTION:
+	if (strcmp(optarg, "arith") == 0) coder = ARITHMETIC_CODER;
+	else if (strcmp(optarg, "range") == 0) coder = RANGE_CODER;
+	else if (strcmp(optarg, "rans") == 0) coder = RANS_CODER;
+	else {
+	  cerr << "sequitur: --coder must be arith, range or rans" << endl;
+	  exit(1);
+	}
+	break;
+      case ORDER_OPTION:
+	order = atoi(optarg);
+	if (order != 0 && order != 1) {
+	  cerr << "sequitur: --order must be 0 or 1" << endl;
+	  exit(1);
+	}
+	break;
+      case TOKENS_OPTION:
+	if (strcmp(optarg, "word") == 0) tokens = WORDS;
+	else if (strcmp(optarg, "line") == 0) tokens = LINES;
+	else {
+	  cerr << "sequitur: --tokens must be word or line" << endl;
+	  exit(1);
+	}
+	break;
     }
   }
 
-  if (K < 1) {
+  if (k < 2) {
     cerr << "sequitur: k must be at least 2" << endl;
     exit(1);
   }
 
-  if (delimiter_string)
+  streaming = frame_size > 0 || frame_milliseconds > 0;
+
+  if (block_size && !do_uncompress &&
+      (!compress || do_print || max_symbols || streaming || tokens)) {
+    cerr << "sequitur: -b is only for -c, without -p, -f, --frame-size,"
+	 << " --frame-ms, --tokens or -w" << endl;
+    exit(1);
+  }
+
+  if (threads < 1 ||
+      (threads > 1 && max_symbols && !do_uncompress &&
+       (!compress || threads > 2))) {
+    cerr << "sequitur: -j needs a number of threads, and can only be -j 2 with"
+	 << " -c -f" << endl;
+    exit(1);
+  }
+
+  if (streaming && threads > 1 && !max_symbols) {
+    cerr << "sequitur: -j cannot be used with --frame-size or --frame-ms,"
+	 << " other than -j 2 with -f" << endl;
+    exit(1);
+  }
+
+  if (tokens == FIXED_WIDTH && token_width != 2 && token_width != 4 &&
+      token_width != 8) {
+    cerr << "sequitur: -w must be 2, 4 or 8" << endl;
+    exit(1);
+  }
+
+  if (tokens && numbers) {
+    cerr << "sequitur: -d cannot be used with --tokens or -w" << endl;
+    exit(1);
+  }
+
+  // with --tokens, the delimiter is the first token
+  if (delimiter_string && tokens == LINES) {
+    string line = string(delimiter_string) + '\n';
+    delimiter = intern_token(line.data(), line.size());
+  }
+  else if (delimiter_string && tokens == FIXED_WIDTH) {
+    uint64_t value = strtoull(delimiter_string, 0, 10);
+    char bytes[8];
+    for (int i = 0; i < token_width; i ++) bytes[i] = value >> (8 * i);
+    delimiter = intern_token(bytes, token_width);
+  }
+  else if (delimiter_string && tokens)
+    delimiter = intern_token(delimiter_string, strlen(delimiter_string));
+  else if (delimiter_string)
     delimiter = numbers ? atoi(delimiter_string) : delimiter_string[0];
 
+  if (optind < argc && do_uncompress) {
+    if (!freopen(argv[optind], "rb", stdin)) {
+      cerr << "sequitur: can't open " << argv[optind] << endl;
+      exit(1);
+    }
+  }
+  else if (optind < argc) open_input(argv[optind]);
+  else open_input(0);
+
 
   //
   // if on MS Windows, set stdin and stdout to binary mode
@@ -157,80 +351,108 @@ int main(int argc, char **argv)
   //
 
   if (do_uncompress) {
-    uncompress();
+    if (!uncompress_blocks(range_offset, range_length))
+      uncompress(stdin, stdout, range_offset, range_length);
+    exit(0);
+  }
+
+  if (block_size) {
+    compress_blocks(block_size);
     exit(0);
   }
 
   if (phind) current_rule = 1;
 
-  S = new rules;
+  sequitur::Grammar grammar(k, delimiter, memory_to_use, quiet);
+  rules *S = grammar.start();
 
 
-  //
-  // read first character and put it in the grammar
-  //
+  if (threads > 1 && !max_symbols) induce_in_parallel(grammar);
+  else {
+    //
+    // read first character and put it in the grammar
+    //
 
-  int i;
+    if (read_symbols(buffer, 1) == 0) buffer[0] = empty_input();
+    grammar.append(buffer, 1);
 
-  if (numbers) cin >> i;
-  else i = cin.get();
-  min_terminal = max_terminal = i;
 
-  S->last()->insert_after(new symbols(i));
 
+    //
+    // now loop reading characters (loop will end upon reaching end of input)
+    //
+    static int last_time = 0;
+    struct timeb tp;
+    ftime(&tp);
+    last_time =  tp.time * 1000 + tp.millitm;
 
+    // symbols not yet sent in a frame, and when the first of them was read
+    int unsent = empty_input_read ? 0 : 1;
+    long unsent_since = milliseconds();
 
-  //
-  // now loop reading characters (loop will end upon reaching end of input)
-  //
-  static int last_time = 0;
-  struct timeb tp;
-  ftime(&tp);
-  last_time =  tp.time * 1000 + tp.millitm;
+    while (1) {
 
-  while (1) {
+      // if no more input comes before the frame is due, send it
+      if (compress && frame_milliseconds && unsent > 0 &&
+	  !wait_for_input(unsent_since + frame_milliseconds - milliseconds())) {
+	send_frame(S);
+	unsent = 0;
+	continue;
+      }
+
+      // read as many characters as fit in the buffer - or only one, if the
+      // grammar may have to be cut down after each - or up to the end of
+      // the frame. On end of input, exit loop
+      int size = max_symbols ? 1 : BUFFER_SIZE;
+      if (compress && frame_size && unsent >= frame_size) {
+	// the symbol read before the loop fills a frame of one symbol
+	send_frame(S);
+	unsent = 0;
+      }
+      if (compress && frame_size && frame_size - unsent < size)
+	size = frame_size - unsent;
+      int n = read_symbols(buffer, size);
+      if (n == 0) break;
 
 // progress indicator
 #ifdef PLATFORM_UNIX
-    if (++ chars % 1000000 == 0 && !quiet) {
-      struct tms buffer;
-      extern int collisions, lookups, occupancy;//, occ[100];
-
-      ftime(&tp);
-      int milliseconds =  tp.time * 1000 + tp.millitm;
-
-      fprintf(stderr, "%3d MB processed, %.2f MB/s, %.3f collisions/lookup, %.2f%% occupancy\n",
-	      chars / 1000000, 1000.0 / (milliseconds - last_time),
-	      collisions/ float(lookups), 100.0 * occupied / table_size);
-      //      last_time = buffer.tms_utime;
-      last_time = milliseconds;
-    }
+      if ((chars + n) / 1000000 > chars / 1000000 && !quiet) {
+	ftime(&tp);
+	int milliseconds =  tp.time * 1000 + tp.millitm;
+
+	fprintf(stderr, "%3d MB processed, %.2f MB/s, %.3f collisions/lookup, %.2f%% occupancy\n",
+		(chars + n) / 1000000, 1000.0 / (milliseconds - last_time),
+		grammar.collisions_per_lookup(), 100.0 * grammar.occupancy());
+	last_time = milliseconds;
+      }
 #endif
-
-    // read a character, if on end of input exit loop
-    if (numbers) cin >> i;
-    else i = cin.get();
-    if (cin.eof()) break;
-
-    if (i < min_terminal) min_terminal = i;
-    else if (i > max_terminal) max_terminal = i;
-
-    // append read character to end of rule S, and enforce constraints
-    S->last()->insert_after(new symbols(i));
-    S->last()->prev()->check();
-
-    // if memory limit reached, "forget" part of the grammar
-    if (max_symbols && num_symbols > max_symbols)
-      if (compress) {
-         // if compression has not been initalized, initialize
-         if (!compression_initialized) {
-            start_compress(false); compression_initialized = true;
-         }
-         // send first symbol of (the remaining part of) the grammar
-	 // to the compressor
-         forget(S->first());
+      chars += n;
+
+      // append read characters to end of rule S, and enforce constraints
+      grammar.append(buffer, n);
+
+      // if memory limit reached, "forget" part of the grammar
+      if (max_symbols && grammar.symbol_count() > max_symbols)
+	if (compress) {
+	   // if compression has not been initalized, initialize
+	   if (!compression_initialized) {
+	      start_compress(false); compression_initialized = true;
+	   }
+	   // send first symbol of (the remaining part of) the grammar
+	   // to the compressor
+	   forget(S->first());
+	}
+	else if (phind) forget_print(S->first());
+
+      if (unsent == 0) unsent_since = milliseconds();
+      unsent += n;
+      if (compress && ((frame_size && unsent >= frame_size) ||
+		       (frame_milliseconds &&
+			milliseconds() - unsent_since >= frame_milliseconds))) {
+	send_frame(S);
+	unsent = 0;
       }
-      else if (phind) forget_print(S->first());
+    }
   }
 
   // now all input has been read,
@@ -243,22 +465,28 @@ int main(int argc, char **argv)
   void calculate_rule_usage(rules *r);
   if (print_rule_usage) calculate_rule_usage(S);
 
-  if (max_symbols || compress || phind) {
+  if (compress) {
     // tell the compressor no more rules will be removed from memory
-    if (compress) stop_forgetting();
-    while (S->first()->next() != S->first())
-      // send symbol to the compressor
-      if (compress) forget(S->first());
-      else if (phind) forget_print(S->first());
+    stop_forgetting();
+    // send the symbols of rule S to the compressor; they are not deleted
+    // one by one, the whole grammar is released at the end
+    if (!empty_input_read)
+      for (symbols *s = S->first(); !s->is_guard(); s = s->next())
+	forget(s);
   }
+  else if (phind)
+    while (S->first()->next() != S->first())
+      forget_print(S->first());
 
   if (compress) end_compress();
 
   if (do_print) {
-     number();
-     print();
+     number(grammar);
+     print(grammar);
   }
 
+  if (table_stats) grammar.print_table_stats();
+
   return 0;
 }
 
@@ -269,7 +497,7 @@ rules **R1;
 int Ri;
 
 // print out the grammar (after non-terminals have been numbered)
-void print()
+void print(sequitur::Grammar &g)
 {
   for (int i = 0; i < Ri; i ++) {
     cout << i << " -> ";
@@ -286,18 +514,18 @@ void print()
   }
 
   if (print_rule_freq)
-    cout << (num_symbols - Ri) << " symbols, " << Ri << " rules "
-	 << (num_symbols * (sizeof(symbols) + 4) + Ri * sizeof(rules))
+    cout << (g.symbol_count() - Ri) << " symbols, " << Ri << " rules "
+	 << (g.symbol_count() * (sizeof(symbols) + 4) + Ri * sizeof(rules))
 	 << " total space\n";
 
 }
 
 // number non-terminal symbols for printing
-void number()
+void number(sequitur::Grammar &g)
 {
-  R1 = (rules **) malloc(sizeof(rules *) * num_rules);
-  memset(R1, 0, sizeof(rules *) * num_rules);
-  R1[0] = S;
+  R1 = (rules **) malloc(sizeof(rules *) * g.rule_count());
+  memset(R1, 0, sizeof(rules *) * g.rule_count());
+  R1[0] = g.start();
   Ri = 1;
 
   for (int i = 0; i < Ri; i ++)
@@ -364,3 +592,319 @@ void calculate_rule_usage(rules *r)
     }
   }
 }
+
+
+// **************************************************************************
+// rules::reproduce()
+//    Reproduce full expansion of a rule.
+// **************************************************************************
+void rules::reproduce()
+{
+  // for each symbol of the rule, call symbols::reproduce(), keeping our
+  // place in the rules we are within on a stack rather than by recursion
+  vector<symbols *> within;
+  symbols *p = first();
+
+  while (1) {
+    if (p->is_guard()) {
+      if (within.empty()) break;
+      p = within.back();
+      within.pop_back();
+    }
+    else if (p->non_terminal()) {
+      within.push_back(p->next());
+      p = p->rule()->first();
+    }
+    else {
+      p->reproduce();
+      p = p->next();
+    }
+  }
+}
+
+// print out symbol, or, if it is non-terminal, rule's full expansion
+void symbols::reproduce()
+{
+  if (non_terminal()) rule()->reproduce();
+  else {
+    cout << *this;
+    if (numbers || tokens == FIXED_WIDTH) cout << ' ';
+  }
+}
+
+
+// **************************************************************************
+// Overload operator << to write symbols of the grammar to streams,
+//    in a formatted manner.
+// **************************************************************************
+static void print_char(ostream &o, int c)
+{
+  if (c == '\n') o << "\\n";
+  else if (c == '\t') o << "\\t";
+  else if (c == ' ' ) o << '_';
+  else if (c == '\\' ||
+       c == '(' ||
+       c == ')' ||
+       c == '_' ||
+       isdigit(c))
+    o << '\\' << char(c);
+  else o << char(c);
+}
+
+ostream &operator << (ostream &o, symbols &s)
+{
+  if (s.non_terminal())
+     o << s.rule()->index();
+  else if (tokens) {
+    size_t length;
+    const char *t = token_text(s.value(), length);
+    if (tokens == FIXED_WIDTH) {
+      // little-endian; a short last word is given as far as it goes
+      uint64_t value = 0;
+      for (size_t i = 0; i < length; i ++)
+	value |= uint64_t((unsigned char) t[i]) << (8 * i);
+      o << '[' << value << ']';
+    }
+    else for (size_t i = 0; i < length; i ++) print_char(o, (unsigned char) t[i]);
+  }
+  else if (numbers) o << '[' << s.value() << ']';
+  else print_char(o, s.value());
+
+  return o;
+}
+
+// **************************************************************************
+// rules::output()
+
+//    Print right hand of this rule. If right hand contains non-terminals,
+//    descend recursively and print right hands of subordinated rules, if
+//    these have not been printed out yet.
+//
+//    Also, numbers the rule, which will indicate that right hand has been
+//    printed out.
+//
+// Global variables used
+//    current_rule, print_rule_usage
+// **************************************************************************
+void rules::output()
+{
+  symbols *s;
+
+  for (s = first(); !s->is_guard(); s = s->next())
+     if (s->non_terminal() && s->rule()->index() == 0)
+        s->rule()->output();
+
+  number = current_rule ++;
+
+  for (s = first(); !s->is_guard(); s = s->next())
+    cout << *s << ' ';
+
+  if (print_rule_usage) cout << "\t(" << Usage << ")";
+
+  cout << endl;
+}
+
+
+// **************************************************************************
+// Read the whole input and split it into 'threads' pieces. The grammar of
+// each piece is formed on a thread of its own, and they are then merged
+// into grammar g (see Grammar::merge()).
+// **************************************************************************
+static void induce_part(sequitur::Grammar *part, const uint32_t *syms, size_t n)
+{
+  part->append(syms, n);
+}
+
+void induce_in_parallel(sequitur::Grammar &g)
+{
+  vector<uint32_t> input;
+  size_t n = 0;
+
+  do {
+    input.resize(n + (1 << 20));
+    n += read_symbols(&input[n], 1 << 20);
+  } while (n == input.size());
+  input.resize(n);
+
+  if (input.empty()) input.push_back(empty_input());
+
+  vector<sequitur::Grammar *> parts(threads);
+  vector<thread> workers;
+  size_t piece = (input.size() + threads - 1) / threads;
+
+  for (int t = 0; t < threads; t ++) {
+    size_t begin = min(input.size(), t * piece);
+    size_t end = min(input.size(), begin + piece);
+    parts[t] = new sequitur::Grammar(k, delimiter, memory_to_use, quiet);
+    workers.push_back(thread(induce_part, parts[t], &input[0] + begin,
+			     end - begin));
+  }
+  for (int t = 0; t < threads; t ++) workers[t].join();
+
+  g.merge(&parts[0], threads);
+
+  for (int t = 0; t < threads; t ++) delete parts[t];
+}
+
+
+// **************************************************************************
+// send_frame(S)
+//    Sends all of rule S to the compressor, which writes it out as a frame.
+//    Only the rules that S used are left in the grammar, to be referred to
+//    by the input that follows.
+// **************************************************************************
+static void send_frame(rules *S)
+{
+  if (!compression_initialized) {
+    start_compress(false);
+    compression_initialized = true;
+  }
+  while (!S->first()->is_guard()) forget(S->first());
+  end_frame();
+}
+
+// time in milliseconds, for --frame-ms; from a monotonic clock where there
+// is one, so that setting the clock does not cut a frame short or hold it
+static long milliseconds()
+{
+#ifdef PLATFORM_UNIX
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000L + t.tv_nsec / 1000000;
+#else
+  struct timeb tp;
+  ftime(&tp);
+  return tp.time * 1000L + tp.millitm;
+#endif
+}
+
+
+// **************************************************************************
+// Reading the input
+//    The input is mapped into memory if it is a file (named on the command
+//    line, or redirected to standard input), and otherwise read in large
+//    blocks. Symbols are taken from the bytes directly: every character,
+//    or with -d, every decimal number (anything but digits and minus signs
+//    separates them).
+// **************************************************************************
+
+static int input_fd;
+static const unsigned char *input_next, *input_end; // unread part of block
+static unsigned char *input_block = 0;   // for read(), if not mapped
+enum { INPUT_BLOCK = 1 << 20 };
+
+// number being read with -d, which may continue in the next block
+static long number_value = 0;
+static bool number_digits = false, number_negative = false;
+
+// Open the named file, or standard input if name is 0.
+void open_input(const char *name)
+{
+  input_fd = 0;
+  if (name && (input_fd = open(name, O_RDONLY)) < 0) {
+    cerr << "sequitur: can't open " << name << endl;
+    exit(1);
+  }
+  input_next = input_end = 0;
+
+#ifdef PLATFORM_UNIX
+  struct stat st;
+  if (fstat(input_fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void *p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, input_fd, 0);
+    if (p != MAP_FAILED) {
+      madvise(p, st.st_size, MADV_SEQUENTIAL);
+      input_next = (const unsigned char *) p;
+      input_end = input_next + st.st_size;
+      return;
+    }
+  }
+#endif
+
+  input_block = (unsigned char *) malloc(INPUT_BLOCK);
+}
+
+// Get the next block of input, if there is one.
+static bool next_block()
+{
+  if (!input_block) return false;    // the whole input was mapped
+
+  long n = read(input_fd, input_block, INPUT_BLOCK);
+  if (n <= 0) return false;
+  input_next = input_block;
+  input_end = input_block + n;
+  return true;
+}
+
+// Wait at most this long for input to read; returns whether there is some,
+// or the end of the input has been reached.
+bool wait_for_input(long milliseconds)
+{
+  if (input_next < input_end || !input_block) return true;
+#ifdef PLATFORM_UNIX
+  struct pollfd p = { input_fd, POLLIN, 0 };
+  return poll(&p, 1, milliseconds > 0 ? milliseconds : 0) != 0;
+#else
+  return true;
+#endif
+}
+
+// Read up to 'size' symbols into buffer; returns how many, 0 at the end.
+int read_symbols(uint32_t *buffer, int size)
+{
+  int n = 0;
+
+  while (n < size) {
+    if (input_next == input_end) {
+      // when streaming, symbols are given out as soon as they are read
+      if (streaming && n > 0) return n;
+      if (!next_block()) break;
+    }
+
+    if (tokens) {
+      n += split_tokens(input_next, input_end, false, buffer + n, size - n);
+      continue;
+    }
+
+    if (!numbers) {
+      int left = input_end - input_next;
+      if (left > size - n) left = size - n;
+      for (int j = 0; j < left; j ++) buffer[n ++] = input_next[j];
+      input_next += left;
+      continue;
+    }
+
+    while (n < size && input_next < input_end) {
+      int c = *input_next ++;
+      if (c >= '0' && c <= '9') {
+	number_value = number_value * 10 + c - '0';
+	number_digits = true;
+	continue;
+      }
+      if (number_digits)
+	buffer[n ++] = number_negative ? -number_value : number_value;
+      number_value = 0;
+      number_digits = false;
+      number_negative = c == '-';
+    }
+  }
+
+  // a number, or a token, may end with the input
+  if (n < size && tokens)
+    n += split_tokens(input_next, input_end, true, buffer + n, size - n);
+  if (n < size && number_digits) {
+    buffer[n ++] = number_negative ? -number_value : number_value;
+    number_value = 0;
+    number_digits = false;
+  }
+
+  return n;
+}
+
+// The first symbol is put in the grammar even if the input is empty: this
+// is the symbol, as it was read with iostreams (or the empty token).
+uint32_t empty_input()
+{
+  empty_input_read = true;
+  if (tokens) return intern_token("", 0);
+  return numbers ? 0 : -1;
+}
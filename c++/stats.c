@@ -336,12 +336,12 @@ int install_symbol(context *pContext, int symbol)
  *
  * encode a symbol given its context
  * the lower and upper bounds are determined using the frequency table,
- * and then passed on to the coder
+ * and then passed on to the coder 'cs'
  * if the symbol has zero frequency, code an escape symbol and
  * return NOT_KNOWN otherwise returns 0
  *
  */
-int encode(context *pContext, int symbol)
+int encode(coder_state *cs, context *pContext, int symbol)
 {
     freq_value low, high, low_w, high_w;
 
@@ -410,7 +410,7 @@ int encode(context *pContext, int symbol)
      * (with low_w, high_w:  Most probable symbol moved to end of range)
      */
 
-    arithmetic_encode(low_w, high_w, pContext->total);
+    arithmetic_encode(cs, low_w, high_w, pContext->total);
 
     if (symbol != 1)		/* If not the special ESC / NOT_KNOWN symbol */
     {
@@ -436,25 +436,25 @@ int encode(context *pContext, int symbol)
 
 /*
  *
- * decode function is passed a context, and returns a symbol
+ * decode function is passed a coder and a context, and returns a symbol
  *
  */
 int 
-decode(context *pContext)
+decode(coder_state *cs, context *pContext)
 {
     int	symbol;
     freq_value low, high, mid, target;
     freq_value total = pContext->total;
  
-    target = arithmetic_decode_target(total);
+    target = arithmetic_decode_target(cs, total);
 
 #ifdef MOST_PROB_AT_END
 	/* Check if most probable symbol (shortcut decode)
 	 */
     if (target >= total - pContext->most_freq_count)
-	{ arithmetic_decode( total - pContext->most_freq_count,
-		 	     total,
-			     total);
+	{ arithmetic_decode(cs, total - pContext->most_freq_count,
+				total,
+				total);
 	  symbol = pContext->most_freq_symbol;
 	  low = pContext->most_freq_pos;
 	  high = low + pContext->most_freq_count;
@@ -511,12 +511,12 @@ decode(context *pContext)
 
 #ifdef MOST_PROB_AT_END
     if (low >= pContext->most_freq_pos)  /* Ie: Was moved */
-	arithmetic_decode(low  - pContext->most_freq_count,
-			  high - pContext->most_freq_count,
-			  total);
+	arithmetic_decode(cs, low  - pContext->most_freq_count,
+			      high - pContext->most_freq_count,
+			      total);
     else
 #endif
-	arithmetic_decode(low, high, total);
+	arithmetic_decode(cs, low, high, total);
 
 #ifdef MOST_PROB_AT_END
   }  /* If not MPS */
@@ -699,6 +699,20 @@ purge_context(context *pContext)
     adjust_zero_freq(pContext);
 }
 
+/*
+ *
+ * free a context and the memory it holds
+ *
+ */
+void
+free_context(context *pContext)
+{
+    if (pContext == NULL)
+	return;
+    free(pContext->tree);
+    free(pContext);
+}
+
 /******************************************************************************
 *
 * functions for binary contexts
@@ -743,9 +757,9 @@ binary_context *create_binary_context(void)
  *
  */
 int
-binary_encode(binary_context *pContext, int bit)
+binary_encode(coder_state *cs, binary_context *pContext, int bit)
 {
-    binary_arithmetic_encode(pContext->c0, pContext->c1, bit);
+    binary_arithmetic_encode(cs, pContext->c0, pContext->c1, bit);
 
     /* increment symbol count */
     if (bit == 0)
@@ -772,11 +786,11 @@ binary_encode(binary_context *pContext, int bit)
  *
  */
 int
-binary_decode(binary_context *pContext)
+binary_decode(coder_state *cs, binary_context *pContext)
 {
     int bit;
 
-    bit = binary_arithmetic_decode(pContext->c0, pContext->c1);
+    bit = binary_arithmetic_decode(cs, pContext->c0, pContext->c1);
 
     /* increment symbol count */
     if (bit == 0)
@@ -95,11 +95,12 @@ extern char *stats_desc;
 context *create_context(int length, int type);
 int install_symbol(context *pTree, int symbol);
 void delete_symbol(context *pTree, int symbol);
-int encode(context *pContext, int symbol);
-int decode(context *pContext);
+int encode(coder_state *cs, context *pContext, int symbol);
+int decode(coder_state *cs, context *pContext);
 void purge_context(context *pContext);
+void free_context(context *pContext);
 binary_context *create_binary_context(void);
-int binary_encode(binary_context *pContext, int bit);
-int binary_decode(binary_context *pContext);
+int binary_encode(coder_state *cs, binary_context *pContext, int bit);
+int binary_decode(coder_state *cs, binary_context *pContext);
 
 #endif
@@ -1,6 +1,19 @@
 #!/usr/bin/perl -w
 
-foreach $sequitur ("./sequitur", "./sequitur_simple") {
+# options given to both -c and -u, for each type of compression test
+%options = ("compression" => "",
+	    "parallel compression" => "-j 4",
+	    "word compression" => "--tokens=word",
+	    "line compression" => "--tokens=line",
+	    "number compression" => "-w 4",
+	    "streamed compression" => "--frame-size=1024",
+	    "block compression" => "-b 4096 -j 3",
+	    "range coder compression" => "--coder=range",
+	    "rANS compression" => "--coder=rans",
+	    "order-1 compression" => "--order=1 -f 1000",
+	    "pipelined compression" => "-f 1000 -j 2");
+
+foreach $sequitur ("./sequitur", "./sequitur_compact", "./sequitur_simple") {
     print "\nTesting $sequitur\n\n";
 
     test("overlapping digrams", 
@@ -35,6 +48,13 @@ foreach $sequitur ("./sequitur", "./sequitur_simple") {
 	 "file",
 	 "exe.input",
 	 "exe.output");
+
+    next if $sequitur =~ /simple/;
+
+    test("words",
+	 "words",
+	 "the cat, the cat",
+	 "0 -> 1 ,_ 1 \n1 -> the _ cat \n");
 }
 
 sub test {
@@ -46,13 +66,24 @@ sub test {
     if ($type eq "string") {
 	$output = `echo -n $input | $sequitur -pq`;
 	$passed = $output eq $desired_output;
+    } elsif ($type eq "words") {
+	$output = `echo -n '$input' | $sequitur -pq --tokens=word`;
+	$passed = $output eq $desired_output;
     } elsif ($type eq "file") {
 	system("$sequitur -pq < testfiles/$input > /tmp/$$.test");
 	$output = `cmp /tmp/$$.test testfiles/$desired_output`;
 	$passed = $output eq "";
-    } elsif ($type eq "compression") {
-	system("$sequitur -cq < testfiles/$input > /tmp/$$.compressed");
-	system("$sequitur -uq < /tmp/$$.compressed > /tmp/$$.test");
+    } elsif ($type eq "range") {
+	# the middle third, from blocks of 1000 bytes
+	$length = int((-s "testfiles/$input") / 3);
+	system("$sequitur -cq -b 1000 < testfiles/$input > /tmp/$$.compressed");
+	system("$sequitur -u --range=$length:$length < /tmp/$$.compressed > /tmp/$$.test");
+	system("tail -c +" . ($length + 1) . " testfiles/$input | head -c $length > /tmp/$$.range");
+	$output = `cmp /tmp/$$.test /tmp/$$.range`;
+	$passed = $output eq "";
+    } elsif (defined $options{$type}) {
+	system("$sequitur -cq $options{$type} < testfiles/$input > /tmp/$$.compressed");
+	system("$sequitur -uq $options{$type} < /tmp/$$.compressed > /tmp/$$.test");
 	$input_size = -s "testfiles/$input";
 	$output_size = -s "/tmp/$$.compressed";
 	$output = `cmp /tmp/$$.test testfiles/$input`;
@@ -67,11 +98,22 @@ sub test {
 	print "Expected $separator\n$desired_output$separator\n\nReceived $separator\n$output$separator\n";
     }
 
-    if ($type eq "compression") {
+    if ($type =~ /compression/) {
 	printf("$input_size in,\t$output_size out,\t%.2f bpc\n", $output_size / $input_size * 8);
     }
 
     if ($type eq "file" && $sequitur !~ /simple/) {
 	test("$name (compression)", "compression", $input, "");
+	test("$name (4 threads)", "parallel compression", $input, "");
+	test("$name (words)", "word compression", $input, "");
+	test("$name (lines)", "line compression", $input, "");
+	test("$name (32-bit numbers)", "number compression", $input, "");
+	test("$name (1K frames)", "streamed compression", $input, "");
+	test("$name (4K blocks)", "block compression", $input, "");
+	test("$name (range)", "range", $input, "");
+	test("$name (range coder)", "range coder compression", $input, "");
+	test("$name (rANS)", "rANS compression", $input, "");
+	test("$name (order 1)", "order-1 compression", $input, "");
+	test("$name (coded on a thread)", "pipelined compression", $input, "");
     }
 }
@@ -0,0 +1,177 @@
+/****************************************************************************
+
+ tokens.cc - Module containing the vocabulary of tokens used with --tokens
+             and -w, and the functions splitting the input into tokens.
+
+ Tokens are numbered from 0 in the order they first appear. Their text is
+ kept one after another in a single array, and an open addressing hash
+ table (power of two size, linear probing) finds the number of a token
+ from its text. Nothing is lost in splitting: with WORDS the text between
+ words is a token too, and with LINES the newline belongs to the line, so
+ the tokens put together give back the input.
+
+ With -w the tokens are numbers of a fixed width, which are numbered like
+ words rather than used as terminals as they are: terminals are coded in a
+ range from the least to the greatest (see compress.cc), which 32 or 64
+ bit values would not fit.
+
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "tokens.h"
+
+extern "C" {
+#include "bitio.h"
+}
+
+int tokens = CHARACTERS, token_width;
+
+static vector<char> text;             // text of all tokens
+static vector<size_t> start;          // where each token starts in text
+static vector<uint32_t> length_of;    // and its length
+static vector<uint64_t> hash_of;      // hash of each token
+
+static vector<uint32_t> slots;        // token number plus one, or 0
+static size_t mask = 0;               // number of slots minus one
+
+static vector<char> pending;          // token continuing in the next block
+
+// hash of a token, eight bytes at a time
+static uint64_t hash_text(const char *p, size_t n)
+{
+  uint64_t h = n * 0x9e3779b97f4a7c15ULL, w;
+
+  for (; n >= 8; n -= 8, p += 8) {
+    memcpy(&w, p, 8);
+    h = (h ^ w) * 0xff51afd7ed558ccdULL;
+    h ^= h >> 32;
+  }
+  w = 0;
+  memcpy(&w, p, n);
+  h = (h ^ w) * 0xc4ceb9fe1a85ec53ULL;
+  return h ^ (h >> 29);
+}
+
+// Put token number 'id' in the hash table, which is doubled when it gets
+// half full.
+static void insert_slot(uint32_t id)
+{
+  if (2 * (start.size() + 1) > slots.size()) {
+    slots.assign(slots.empty() ? 1024 : 2 * slots.size(), 0);
+    mask = slots.size() - 1;
+    for (uint32_t i = 0; i < id; i ++) insert_slot(i);
+  }
+
+  size_t s = hash_of[id] & mask;
+  while (slots[s]) s = (s + 1) & mask;
+  slots[s] = id + 1;
+}
+
+static uint32_t add_token(const char *p, size_t n, uint64_t h)
+{
+  uint32_t id = start.size();
+
+  start.push_back(text.size());
+  length_of.push_back(n);
+  hash_of.push_back(h);
+  text.insert(text.end(), p, p + n);
+  insert_slot(id);
+  return id;
+}
+
+uint32_t intern_token(const char *p, size_t n)
+{
+  uint64_t h = hash_text(p, n);
+
+  if (!slots.empty())
+    for (size_t s = h & mask; slots[s]; s = (s + 1) & mask) {
+      uint32_t id = slots[s] - 1;
+      if (hash_of[id] == h && length_of[id] == n &&
+	  memcmp(&text[start[id]], p, n) == 0)
+	return id;
+    }
+
+  return add_token(p, n, h);
+}
+
+// Tokens are spelled out in a compressed file the first time they are
+// used. That is nearly the order they were numbered in, but not quite: the
+// delimiter is numbered first, and may never be used.
+void define_token(uint32_t id, const char *p, size_t n)
+{
+  if (id >= start.size()) {
+    start.resize(id + 1, text.size());
+    length_of.resize(id + 1, 0);
+  }
+  start[id] = text.size();
+  length_of[id] = n;
+  text.insert(text.end(), p, p + n);
+}
+
+const char *token_text(uint32_t id, size_t &n)
+{
+  if (id >= start.size()) {
+    char message[64];
+    snprintf(message, sizeof(message),
+	     "sequitur: token %u not defined in compressed input", id);
+    bitio_error(message);
+  }
+  n = length_of[id];
+  return &text[start[id]];
+}
+
+static inline bool word_char(int c)
+{
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+    (c >= '0' && c <= '9') || c >= 0x80;
+}
+
+int split_tokens(const unsigned char *&next, const unsigned char *end,
+		 bool at_end, uint32_t *buffer, int size)
+{
+  int n = 0;
+
+  while (n < size && next < end) {
+    const unsigned char *p = next, *q;
+
+    if (tokens == FIXED_WIDTH) {
+      size_t needed = token_width - pending.size();
+      q = size_t(end - p) >= needed ? p + needed : 0;
+    }
+    else if (tokens == LINES) {
+      q = (const unsigned char *) memchr(p, '\n', end - p);
+      if (q) q ++;
+    }
+    else {
+      bool word = word_char(pending.empty() ? *p : (unsigned char) pending[0]);
+      for (q = p; q < end && word_char(*q) == word; q ++) ;
+      if (q == end) q = 0;
+    }
+
+    if (!q) {
+      pending.insert(pending.end(), p, end);
+      next = end;
+      break;
+    }
+
+    if (pending.empty())
+      buffer[n ++] = intern_token((const char *) p, q - p);
+    else {
+      pending.insert(pending.end(), p, q);
+      buffer[n ++] = intern_token(&pending[0], pending.size());
+      pending.clear();
+    }
+    next = q;
+  }
+
+  if (n < size && next == end && at_end && !pending.empty()) {
+    buffer[n ++] = intern_token(&pending[0], pending.size());
+    pending.clear();
+  }
+
+  return n;
+}
@@ -0,0 +1,37 @@
+/****************************************************************************
+
+ tokens.h - Splitting text into words or lines (--tokens), or binary input
+            into numbers (-w), and numbering the distinct ones, so that
+            sequitur can form rules of tokens rather than of characters.
+
+****************************************************************************/
+
+#include <stdint.h>
+#include <iostream>
+
+using namespace std;
+
+// how the input is split into symbols
+enum { CHARACTERS,   // every byte is a symbol (or a number, with -d)
+       WORDS,        // runs of letters and digits, and the runs between them
+       LINES,        // lines, each with the newline that ends it
+       FIXED_WIDTH };// numbers of token_width bytes, little-endian (-w)
+
+extern int tokens, token_width;
+
+// number of the token, which is added to the vocabulary if it is new
+uint32_t intern_token(const char *text, size_t length);
+
+// enter token number 'id', read from a compressed file, in the vocabulary
+// (which is then only used by token_text())
+void define_token(uint32_t id, const char *text, size_t length);
+
+// text of a token in the vocabulary
+const char *token_text(uint32_t id, size_t &length);
+
+// Split bytes from 'next' up to 'end' into tokens, and put the numbers of
+// at most 'size' of them in buffer; returns how many. 'next' is moved past
+// them. A token that reaches 'end' is kept until more input is given, or
+// until it is called with next == end and at_end set.
+int split_tokens(const unsigned char *&next, const unsigned char *end,
+		 bool at_end, uint32_t *buffer, int size);